@@ -23,11 +23,16 @@ extern "C" {
 
 // ================= Device Register Specifications ==================
 
+// BLIT copies each rect from a screen-sized source of pitch pixels per row
+// to the same place on the screen
+typedef struct { int x, y, w, h; } _DEV_VIDEO_RECT_t;
+
 _AM_DEVREG(INPUT,  KBD,    1, int keydown, keycode);
 _AM_DEVREG(TIMER,  UPTIME, 1, uint32_t hi, lo);
 _AM_DEVREG(TIMER,  DATE,   2, int year, month, day, hour, minute, second);
 _AM_DEVREG(VIDEO,  INFO,   1, int width, height);
 _AM_DEVREG(VIDEO,  FBCTL,  2, int x, y; uint32_t *pixels; int w, h, sync);
+_AM_DEVREG(VIDEO,  BLIT,   3, uint32_t *pixels; int pitch, nr; _DEV_VIDEO_RECT_t *rects; int sync);
 _AM_DEVREG(SERIAL, RECV,   1, uint8_t data);
 _AM_DEVREG(SERIAL, SEND,   2, uint8_t data);
 _AM_DEVREG(SERIAL, STAT,   3, uint8_t data);
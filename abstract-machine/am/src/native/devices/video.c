@@ -69,6 +69,18 @@ size_t video_write(uintptr_t reg, void *buf, size_t size) {
       }
       return size;
     }
+    case _DEVREG_VIDEO_BLIT: {
+      _DEV_VIDEO_BLIT_t *ctl = (_DEV_VIDEO_BLIT_t *)buf;
+      for (int k = 0; k < ctl->nr; k ++) {
+        _DEV_VIDEO_RECT_t *r = &ctl->rects[k];
+        if (r->x < 0 || r->y < 0 || r->x >= W) continue;
+        int cp_bytes = sizeof(uint32_t) * min(r->w, W - r->x);
+        for (int y = r->y; y < r->y + r->h && y < H; y ++) {
+          memcpy(&fb[y * W + r->x], &ctl->pixels[y * ctl->pitch + r->x], cp_bytes);
+        }
+      }
+      return size;
+    }
   }
   return 0;
 }
@@ -71,6 +71,24 @@ size_t video_read(uintptr_t reg, void *buf, size_t size) {
   return 0;
 }
 
+typedef uint32_t __attribute__((aligned(1), may_alias)) u32_unaligned;
+
+static void row_copy(FBPixel *v, const uint32_t *pixels, int len) {
+  // packs four 0RGB pixels into three words of BGR triples
+  int i = 0;
+  for (; i + 4 <= len; i += 4, v += 4) {
+    uint32_t p0 = pixels[i], p1 = pixels[i + 1], p2 = pixels[i + 2], p3 = pixels[i + 3];
+    u32_unaligned *w = (u32_unaligned *)v;
+    w[0] = (p0 & 0xffffff) | (p1 << 24);
+    w[1] = ((p1 >> 8) & 0xffff) | (p2 << 16);
+    w[2] = ((p2 >> 16) & 0xff) | (p3 << 8);
+  }
+  for (; i < len; i ++, v ++) {
+    uint32_t p = pixels[i];
+    v->r = R(p); v->g = G(p); v->b = B(p);
+  }
+}
+
 size_t video_write(uintptr_t reg, void *buf, size_t size) {
   switch(reg) {
     case _DEVREG_VIDEO_FBCTL: {
@@ -78,14 +96,9 @@ size_t video_write(uintptr_t reg, void *buf, size_t size) {
       int x = ctl->x, y = ctl->y, w = ctl->w, h = ctl->h;
       uint32_t *pixels = ctl->pixels;
       int len = (x + w >= W) ? W - x : w;
-      FBPixel *v;
       for (int j = 0; j < h; j ++) {
         if (y + j < H) {
-          v = &fb[x + (j + y) * W];
-          for (int i = 0; i < len; i ++, v ++) {
-            uint32_t p = pixels[i];
-            v->r = R(p); v->g = G(p); v->b = B(p);
-          }
+          row_copy(&fb[x + (j + y) * W], pixels, len);
         }
         pixels += w;
       }
@@ -94,7 +107,18 @@ size_t video_write(uintptr_t reg, void *buf, size_t size) {
       }
       return sizeof(*ctl);
     }
+    case _DEVREG_VIDEO_BLIT: {
+      _DEV_VIDEO_BLIT_t *ctl = (_DEV_VIDEO_BLIT_t *)buf;
+      for (int k = 0; k < ctl->nr; k ++) {
+        _DEV_VIDEO_RECT_t *r = &ctl->rects[k];
+        if (r->x < 0 || r->y < 0 || r->x >= W) continue;
+        int len = (r->x + r->w >= W) ? W - r->x : r->w;
+        for (int y = r->y; y < r->y + r->h && y < H; y ++) {
+          row_copy(&fb[r->x + y * W], &ctl->pixels[r->x + y * ctl->pitch], len);
+        }
+      }
+      return sizeof(*ctl);
+    }
   }
   return 0;
 }
-
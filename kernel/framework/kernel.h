@@ -46,6 +46,12 @@ typedef struct devops {
   int (*init)(device_t *dev);
   ssize_t (*read)(device_t *dev, off_t offset, void *buf, size_t count);
   ssize_t (*write)(device_t *dev, off_t offset, const void *buf, size_t count);
+  ssize_t (*writev)(device_t *dev, off_t offset, const struct iovec *iov, int iovcnt); // optional
+  off_t (*size)(device_t *dev); // optional, in bytes
+  // optional, points read-only at the bytes at offset and trims *count to
+  // the part that is contiguous in memory, NULL if it cannot be mapped
+  void *(*map)(device_t *dev, off_t offset, size_t *count);
+  int (*ioctl)(device_t *dev, int request, void *arg); // optional
 } devops_t;
 typedef struct {
   void (*init)();
@@ -61,6 +67,7 @@ typedef struct {
   int (*access)(const char *path, int mode);
   int (*mount)(const char *path, filesystem_t *fs);
   int (*unmount)(const char *path);
+  void (*sync)();
   int (*readdir)(const char *path, void* buf);
   int (*mkdir)(const char *path);
   int (*rmdir)(const char *path);
@@ -69,8 +76,15 @@ typedef struct {
   int (*open)(const char *path, int flags);
   ssize_t (*read)(int fd, void *buf, size_t nbyte);
   ssize_t (*write)(int fd, void *buf, size_t nbyte);
+  ssize_t (*pread)(int fd, void *buf, size_t nbyte, off_t offset);
+  ssize_t (*pwrite)(int fd, void *buf, size_t nbyte, off_t offset);
+  ssize_t (*readv)(int fd, const struct iovec *iov, int iovcnt);
+  ssize_t (*writev)(int fd, const struct iovec *iov, int iovcnt);
   off_t (*lseek)(int fd, off_t offset, int whence);
+  ssize_t (*get_page)(int fd, off_t offset, const void **page);
+  int (*ioctl)(int fd, int request, void *arg);
   int (*close)(int fd);
+  int (*dup)(int fd);
 } MODULE(vfs);
 
 
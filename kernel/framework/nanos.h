@@ -6,4 +6,9 @@ typedef intptr_t ssize_t;
 typedef intptr_t off_t;
 typedef int32_t pid_t;
 
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
 #endif
@@ -0,0 +1,64 @@
+#ifndef __BLKDEV_H__
+#define __BLKDEV_H__
+
+#include <common.h>
+
+/**
+ * Block device layer. I/O is described by bios of whole sectors and queued
+ * on the device; a bio that extends a queued request of the same direction
+ * is merged into it. Drivers serve one merged request at a time and every
+ * bio completes through its callback. The queue runs on submit unless it is
+ * plugged, so a batch submitted between blk_plug() and blk_unplug() reaches
+ * the driver as few large requests.
+ */
+
+#define BLK_SECTOR_SIZE 512
+#define BLK_MAX_SECTORS 256 // largest merged request
+
+#define BIO_READ  0
+#define BIO_WRITE 1
+
+#define BIO_DONE 0x1
+
+struct bio {
+  int op;
+  int flags;
+  int status; // 0 or a negative error once done
+  uint32_t sector;
+  uint32_t nr_sectors;
+  char *buf;
+  void (*done)(struct bio *bio); // optional
+  void *priv;
+  struct bio *next; // within its request
+};
+
+struct request {
+  int op;
+  uint32_t sector;
+  uint32_t nr_sectors;
+  struct bio *head, *tail; // contiguous on the device, in order
+  struct request *next;    // queue order
+};
+
+typedef struct blkdev blkdev_t;
+struct blkdev {
+  const char *name;
+  off_t size;          // in bytes, the last sector may be partial
+  uint32_t nr_sectors;
+  int (*request)(blkdev_t *bdev, struct request *rq); // 0 or a negative error
+  void *ptr;           // driver data
+  struct spinlock lock;
+  int plugged;
+  struct request *queue, *tail;
+  uint32_t nr_requests, nr_merged; // sent to the driver / bios merged away
+};
+
+void blk_init(blkdev_t *bdev, const char *name, off_t size,
+    int (*request)(blkdev_t *bdev, struct request *rq), void *ptr);
+void blk_submit(blkdev_t *bdev, struct bio *bio);
+void blk_run(blkdev_t *bdev);
+void blk_plug(blkdev_t *bdev);
+void blk_unplug(blkdev_t *bdev);
+void blk_wait(blkdev_t *bdev, struct bio *bio);
+
+#endif
@@ -23,7 +23,11 @@
 #include <devices.h>
 #include <spinlock.h>
 #include <semaphore.h>
+#include <workqueue.h>
 #include <file.h>
+#include <dcache.h>
+#include <blkdev.h>
+#include <pcache.h>
 #include <vfs.h>
 
 #define likely(x)   __builtin_expect(!!(x), 1)
@@ -0,0 +1,31 @@
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include <common.h>
+
+/**
+ * Dentry cache, maps (parent inode, component name) to inode.
+ * An entry with a NULL inode is negative: the name is known to be absent.
+ * The cache holds at most NR_DCACHE_ENTRIES entries, the least recently
+ * used one is reused once it is full.
+ */
+
+#define NR_DCACHE_BUCKETS 256
+#define NR_DCACHE_ENTRIES 1024
+#define NR_DCACHE_NAME    64
+
+struct dentry {
+  inode_t *parent;
+  inode_t *inode;
+  uint32_t hash;
+  size_t len;
+  char name[NR_DCACHE_NAME];
+  struct dentry *next;             // in its bucket
+  struct dentry *lru_prev, *lru_next; // most recent first
+};
+
+inode_t *dcache_lookup(inode_t *parent, const char *name, size_t len, bool *hit);
+void dcache_enter(inode_t *parent, const char *name, size_t len, inode_t *inode);
+void dcache_purge(inode_t *inode);
+
+#endif
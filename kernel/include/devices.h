@@ -16,6 +16,7 @@ struct device {
   int id;
   void *ptr;
   devops_t *ops;
+  struct blkdev *blk; // request queue of block devices, NULL otherwise
 };
 
 device_t *dev_lookup(const char *name);
@@ -29,28 +30,38 @@ struct input_event {
   uint32_t data: 16;
 };
 
+// events is a single-producer single-consumer ring: only the keyboard
+// bottom half moves rear and only the reader holding reader moves front,
+// so neither side locks the ring; event_sem puts an empty reader to sleep,
+// and a full ring leaves keys in the controller until the reader requeues
+// the bottom half
 typedef struct {
-  spinlock_t lock;
-  sem_t event_sem;
+  sem_t event_sem, reader;
   struct input_event *events;
-  int front, rear;
+  volatile uint32_t front, rear; // free running, taken modulo NEVENTS
   int capslock, shift_down[2], ctrl_down[2], alt_down[2];
 } input_t;
 
 // RAM disk
 // -------------------------------------------------------------------
 
-#define RD_SIZE (4 << 20)
+#define RD_SIZE      (4 << 20)
+#define RD_PAGE_SIZE 4096
 
+// a disk is either one contiguous region [start, end) or, when pages is
+// set, size bytes of pages allocated on first write
 typedef struct {
   char *start, *end;
+  char **pages;
+  size_t size;
+  struct spinlock lock; // protects pages
 } rd_t;
 
 // -------------------------------------------------------------------
 
 // Sprite-based virtual graphic accelerator
 // +--------------+---------------------------------+-------------
-// |  Info (256B) | textures (65535 x 256B = 16M)   |  sprites
+// |  Info (256B) | textures (65535 x 256B = 16M)   |  sprite slots
 // +--------------+---------------------------------+-------------
 //        |            |                            ^        |
 //        |            v                        0x1000000    |
@@ -81,10 +92,35 @@ struct sprite {
   unsigned int z: 12;
 } __attribute__((packed));
 
+// every display has its own sprite table and a retained back buffer the
+// sprites are composed into; only tiles under changed sprites are composed
+// again, and only the current display is blitted to the screen
+struct fb_display {
+  struct sprite *sprites; // num_sprites slots, texture 0 is an empty slot
+  int nr_used;            // slots from here on are all empty
+  uint32_t *back;         // width x height
+  uint8_t *dirty;         // per TEXTURE_W x TEXTURE_H tile
+  bool changed;
+};
+
+// fb ioctl requests
+#define FB_SCROLL 1
+
+// moves everything on a display up dy pixels and slot k + slots to slot
+// k, so slots laid out in screen order stay that way
+struct fb_scroll {
+  int display;
+  int dy;
+  int slots;
+};
+
 typedef struct {
   struct display_info *info;
   struct texture *textures;
-  struct sprite *sprites;
+  struct fb_display *displays; // allocated on first use
+  int tiles_w, tiles_h;
+  int *order, *zcount;         // for sorting slots by z
+  _DEV_VIDEO_RECT_t *rects;
 } fb_t;
 
 // -------------------------------------------------------------------
@@ -95,17 +131,47 @@ struct character {
   unsigned char ch;
 };
 
+// input waiting to be read: [head, cooked) is readable, [cooked, tail)
+// is the line being edited; offsets into the ring of size bytes
 struct tty_queue {
-  char *buf, *end, *front, *rear;
+  char *buf;
+  int size;
+  int head, cooked, tail;
+};
+
+#define TTY_RAW      0x1 // no line editing or echo, input is readable at once
+#define TTY_NONBLOCK 0x2 // reads return E_AGAIN instead of waiting for input
+
+// tty ioctl requests, arg points at a struct tty_mode
+#define TTY_GETMODE 1
+#define TTY_SETMODE 2
+
+struct tty_mode {
+  int flags;
+  int qsize; // bytes of input the tty holds, 0 keeps the size on TTY_SETMODE
 };
 
+struct tty_span {
+  int lo, hi; // dirty columns [lo, hi) of a line
+};
+
+#define TTY_HISTORY 256    // scrollback lines kept above the screen
+
+// buf is a ring of rows lines; screen line y is ring line top + y, lines
+// before it are history, view of them shown while scrolled back
 typedef struct {
   sem_t lock, cooked;
   device_t *fbdev; int display;
   int lines, columns, size;
-  struct character *buf, *end, *cursor;
+  int rows, top, history, view;
+  int cur_x, cur_y; // cursor on the screen
+  struct character *buf;
   struct tty_queue queue;
-  uint8_t *dirty;
+  int mode;
+  struct tty_span *dirty;    // per line
+  int dirty_top, dirty_bot;  // lines [top, bot) hold dirty spans
+  int scrolled;              // lines the fb has yet to move up
+  struct sprite *batch;      // two sprite slots per cell, sent in one write
 } tty_t;
 
 extern char keymap[], keymap_shift[];
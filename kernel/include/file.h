@@ -19,17 +19,21 @@
 #define E_BADPR -5 // bad privilege
 #define E_TOOLG -6 // too long / large
 #define E_NOEMP -7 // not empty
+#define E_AGAIN -8 // would block
 
 #define SEEK_SET 0x00
 #define SEEK_CUR 0x01
 #define SEEK_END 0x02
 
+#define NR_FILES 256 // system-wide open file descriptions
+
 struct file {
-  int fd;
   int refcnt;
   int flags;
   inode_t *inode;
-  uint64_t offset;
+  off_t offset;
+  void *ptr;         // private to the inode's open/close
+  struct file *next; // next free slot in the open file table
 };
 
 struct inodeops {
@@ -37,7 +41,16 @@ struct inodeops {
   int (*close)(filesystem_t *fs, file_t *file);
   ssize_t (*read)(filesystem_t *fs, file_t *file, char *buf, size_t size);
   ssize_t (*write)(filesystem_t *fs, file_t *file, const char *buf, size_t size);
+  ssize_t (*pread)(filesystem_t *fs, file_t *file, char *buf, size_t size, off_t offset);
+  ssize_t (*pwrite)(filesystem_t *fs, file_t *file, const char *buf, size_t size, off_t offset);
+  ssize_t (*readv)(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt);
+  ssize_t (*writev)(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt);
   off_t (*lseek)(filesystem_t *fs, file_t *file, off_t offset, int whence);
+  // points *page at the file's bytes at offset without copying them,
+  // returns how many are readable there, 0 at the end of the file
+  ssize_t (*get_page)(filesystem_t *fs, file_t *file, off_t offset, const void **page);
+  // device specific requests, E_BADTP for files
+  int (*ioctl)(filesystem_t *fs, file_t *file, int request, void *arg);
   int (*mkdir)(filesystem_t *fs, const char *name);
   int (*rmdir)(filesystem_t *fs, const char *name);
   int (*link)(filesystem_t *fs, const char *name, inode_t *inode);
@@ -66,8 +79,8 @@ struct inode {
   void *ptr;
   int32_t blk;
   char path[256];
-  off_t offset;
   size_t size;
+  struct spinlock lock; // protects data and size
   filesystem_t *fs;
   inodeops_t *ops;
 
@@ -81,7 +94,13 @@ int naive_open(filesystem_t *fs, file_t *file, int flags);
 int naive_close(filesystem_t *fs, file_t *file);
 ssize_t naive_read(filesystem_t *fs, file_t *file, char *buf, size_t size);
 ssize_t naive_write(filesystem_t *fs, file_t *file, const char *buf, size_t size);
+ssize_t naive_pread(filesystem_t *fs, file_t *file, char *buf, size_t size, off_t offset);
+ssize_t naive_pwrite(filesystem_t *fs, file_t *file, const char *buf, size_t size, off_t offset);
+ssize_t naive_readv(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt);
+ssize_t naive_writev(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt);
 off_t naive_lseek(filesystem_t *fs, file_t *file, off_t offset, int whence);
+ssize_t naive_get_page(filesystem_t *fs, file_t *file, off_t offset, const void **page);
+int naive_ioctl(filesystem_t *fs, file_t *file, int request, void *arg);
 int naive_mkdir(filesystem_t *fs, const char *path);
 int naive_rmdir(filesystem_t *fs, const char *path);
 int naive_link(filesystem_t *fs, const char *path, inode_t *inode);
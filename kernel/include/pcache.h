@@ -0,0 +1,42 @@
+#ifndef __PCACHE_H__
+#define __PCACHE_H__
+
+#include <common.h>
+
+/**
+ * Page cache, keeps fixed-size pages of block devices in memory.
+ * Pages are keyed by (device, page-aligned offset) and evicted in LRU
+ * order; dirty pages are written back on eviction or on pcache_sync().
+ * Devices with a request queue are accessed through bios of whole sectors.
+ */
+
+#define PCACHE_PAGE_SIZE  4096
+#define NR_PCACHE_PAGES   128
+#define NR_PCACHE_BUCKETS 64
+
+#define PG_VALID 0x1
+#define PG_DIRTY 0x2
+
+struct page {
+  device_t *dev;
+  off_t offset;
+  int flags;
+  int refcnt;
+  size_t dirty_lo, dirty_hi; // dirty byte range within the page
+  char *data;
+  struct bio bio; // fill or writeback in flight
+  struct page *hnext;
+  struct page *prev, *next; // LRU list, most recent first
+};
+
+void pcache_init();
+struct page *pcache_get(device_t *dev, off_t offset);
+void pcache_put(struct page *pg);
+void pcache_dirty(struct page *pg, size_t lo, size_t hi);
+ssize_t pcache_read(device_t *dev, off_t offset, void *buf, size_t count);
+ssize_t pcache_write(device_t *dev, off_t offset, const void *buf, size_t count);
+void pcache_flush(device_t *dev, off_t offset, size_t count);
+void pcache_sync(device_t *dev);
+void pcache_invalidate(device_t *dev);
+
+#endif
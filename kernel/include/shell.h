@@ -27,5 +27,7 @@ FUNC(link);
 FUNC(mkdir);
 FUNC(rmdir);
 FUNC(rm);
+FUNC(fsbench);
+FUNC(sync);
 
 #endif
@@ -51,11 +51,31 @@ struct task {
   void *alarm;
   bool suicide;
 
+  // accounting, times in TSC cycles
+  uint64_t runtime;
+  uint64_t sleeptime;     // waiting on semaphores
+  uint32_t nvcsw, nivcsw; // voluntary / involuntary context switches
+  int last_cpu;
+
   file_t *fildes[NR_FILDS];
+  uint32_t fdmap[NR_FILDS / 32]; // bit set = fd in use
 
   struct task *next;
 };
 
+struct cpu_stat {
+  uint64_t busy, idle, trap; // TSC cycles running tasks / idle / in traps
+  uint64_t stamp;            // last accounting point
+  struct task *prev;         // task interrupted by the current trap
+};
+extern struct cpu_stat cpu_stats[MAX_CPU];
+
+static inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
 struct task *get_current_task();
 void set_current_task(struct task *);
 
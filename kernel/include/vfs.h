@@ -18,26 +18,52 @@ struct fsops {
   void (*init)(filesystem_t *fs, const char *path, device_t *dev);
   inode_t *(*lookup)(filesystem_t *fs, const char *path, int flags);
   int (*close)(inode_t *inode);
+  // optional, brings a child of dir that is not in memory yet into the tree
+  inode_t *(*fetch)(filesystem_t *fs, inode_t *dir, const char *name, size_t len);
+  // optional, writes every pending update home
+  void (*sync)(filesystem_t *fs);
 };
 extern fsops_t naivefs_ops;
 
+// Lock order, outermost first; a path may skip any of them but never
+// takes them the other way round, nor two of one kind at once:
+//   vfs_lock      the mount table
+//   fs->lock      the tree, the inode cache and directories of one fs
+//   journal lock  an open naivefs transaction
+//   inode lock    data and size of one inode
+//   info->lock    the naivefs block bitmap
+//   pcache_lock   the page cache
+//   bdev->lock    the request queue of a block device
+// The dcache lock is only ever taken last. Reads and writes skip
+// fs->lock and start at the journal or the inode lock.
 struct filesystem {
   const char *name;
   inode_t *root;
   fsops_t *ops;
   device_t *dev;
+  void *ptr;            // fs-private data
+  struct spinlock lock; // protects metadata, see the lock order above
 };
 extern filesystem_t naivefs;
 
+#define NR_MOUNTS 16 // entries in the mount table, / included
+
 typedef struct mnt_table {
   const char *path;
+  size_t len;
   filesystem_t *fs;
   struct mnt_table *next;
   struct mnt_table *prev;
 } mnt_t;
 
+filesystem_t *find_fs(const char *path);
+
 void naivefs_init(filesystem_t *fs, const char *name, device_t *dev);
+int naivefs_mkfs(device_t *dev, int32_t blk_size);
+int naivefs_bench(int32_t blk_size, size_t nbytes, uint32_t *wtime, uint32_t *rtime);
 inode_t *naivefs_lookup(filesystem_t *fs, const char *path, int flags);
 int naivefs_close(inode_t *inode);
+inode_t *naivefs_fetch(filesystem_t *fs, inode_t *dir, const char *name, size_t len);
+void naivefs_sync(filesystem_t *fs);
 
 #endif
@@ -0,0 +1,24 @@
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#include <common.h>
+
+/**
+ * Deferred work. An interrupt handler does the least it must and queues a
+ * work item; the kworker task runs it later with interrupts on, where it
+ * may take semaphores. Queueing an item that is still pending does
+ * nothing, so a burst of interrupts costs one run.
+ */
+
+struct work {
+  void (*func)(struct work *work);
+  void *arg;
+  bool pending;
+  struct work *next;
+};
+
+void work_init(struct work *work, void (*func)(struct work *), void *arg);
+void work_queue(struct work *work);
+void workqueue_init();
+
+#endif
@@ -0,0 +1,118 @@
+#include <common.h>
+#include <blkdev.h>
+
+void blk_init(blkdev_t *bdev, const char *name, off_t size,
+    int (*request)(blkdev_t *bdev, struct request *rq), void *ptr) {
+  bdev->name = name;
+  bdev->size = size;
+  bdev->nr_sectors = (size + BLK_SECTOR_SIZE - 1) / BLK_SECTOR_SIZE;
+  bdev->request = request;
+  bdev->ptr = ptr;
+  spinlock_init(&bdev->lock, name);
+  bdev->plugged = 0;
+  bdev->queue = bdev->tail = NULL;
+  bdev->nr_requests = bdev->nr_merged = 0;
+}
+
+static inline bool blk_overlap(struct request *rq, struct bio *bio) {
+  return rq->sector < bio->sector + bio->nr_sectors && bio->sector < rq->sector + rq->nr_sectors;
+}
+
+static struct request *blk_find_merge(blkdev_t *bdev, struct bio *bio) {
+  // caller holds bdev->lock; a bio may not jump ahead of a later request
+  // touching the same sectors, so only candidates after the last one count
+  struct request *ret = NULL;
+  for (struct request *rq = bdev->queue; rq != NULL; rq = rq->next) {
+    if (blk_overlap(rq, bio)) {
+      ret = NULL;
+    } else if (rq->op == bio->op && rq->nr_sectors + bio->nr_sectors <= BLK_MAX_SECTORS
+        && (rq->sector + rq->nr_sectors == bio->sector || bio->sector + bio->nr_sectors == rq->sector)) {
+      ret = rq;
+    }
+  }
+  return ret;
+}
+
+void blk_submit(blkdev_t *bdev, struct bio *bio) {
+  bio->flags &= ~BIO_DONE;
+  bio->status = 0;
+  bio->next = NULL;
+
+  spinlock_acquire(&bdev->lock);
+  struct request *rq = blk_find_merge(bdev, bio);
+  if (rq && rq->sector + rq->nr_sectors == bio->sector) {
+    rq->tail->next = bio;
+    rq->tail = bio;
+    rq->nr_sectors += bio->nr_sectors;
+    ++bdev->nr_merged;
+  } else if (rq) {
+    bio->next = rq->head;
+    rq->head = bio;
+    rq->sector = bio->sector;
+    rq->nr_sectors += bio->nr_sectors;
+    ++bdev->nr_merged;
+  } else {
+    rq = pmm->alloc(sizeof(struct request));
+    rq->op = bio->op;
+    rq->sector = bio->sector;
+    rq->nr_sectors = bio->nr_sectors;
+    rq->head = rq->tail = bio;
+    rq->next = NULL;
+    if (bdev->tail) {
+      bdev->tail->next = rq;
+    } else {
+      bdev->queue = rq;
+    }
+    bdev->tail = rq;
+  }
+  bool run = bdev->plugged == 0;
+  spinlock_release(&bdev->lock);
+
+  if (run) blk_run(bdev);
+}
+
+void blk_run(blkdev_t *bdev) {
+  // hands every queued request to the driver, then completes its bios
+  spinlock_acquire(&bdev->lock);
+  struct request *rq = bdev->queue;
+  bdev->queue = bdev->tail = NULL;
+  spinlock_release(&bdev->lock);
+
+  while (rq) {
+    struct request *next = rq->next;
+    int status = rq->sector + rq->nr_sectors <= bdev->nr_sectors ? bdev->request(bdev, rq) : -1;
+    for (struct bio *bio = rq->head; bio != NULL; ) {
+      struct bio *bnext = bio->next;
+      bio->status = status;
+      bio->flags |= BIO_DONE;
+      if (bio->done) bio->done(bio);
+      bio = bnext;
+    }
+    spinlock_acquire(&bdev->lock);
+    ++bdev->nr_requests;
+    spinlock_release(&bdev->lock);
+    pmm->free(rq);
+    rq = next;
+  }
+}
+
+void blk_plug(blkdev_t *bdev) {
+  spinlock_acquire(&bdev->lock);
+  ++bdev->plugged;
+  spinlock_release(&bdev->lock);
+}
+
+void blk_unplug(blkdev_t *bdev) {
+  spinlock_acquire(&bdev->lock);
+  Assert(bdev->plugged > 0, "unplugging %s more than plugged", bdev->name);
+  bool run = --bdev->plugged == 0;
+  spinlock_release(&bdev->lock);
+
+  if (run) blk_run(bdev);
+}
+
+void blk_wait(blkdev_t *bdev, struct bio *bio) {
+  // every driver so far completes requests before returning from them
+  if (!(bio->flags & BIO_DONE)) blk_run(bdev);
+  Assert(bio->flags & BIO_DONE, "bio on %s did not complete", bdev->name);
+}
@@ -0,0 +1,116 @@
+#include <common.h>
+#include <dcache.h>
+
+static struct spinlock dcache_lock = {
+  "dcache lock", 0, -1
+};
+static struct dentry *buckets[NR_DCACHE_BUCKETS] = {};
+static struct dentry lru = { .lru_prev = &lru, .lru_next = &lru };
+static int nr_dentries = 0;
+
+static inline uint32_t dcache_hash(inode_t *parent, const char *name, size_t len) {
+  // FNV-1a over the name, seeded with the parent
+  uint32_t hash = 2166136261u ^ (uint32_t)(uintptr_t)parent;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static inline struct dentry *dcache_find(inode_t *parent, const char *name, size_t len, uint32_t hash) {
+  for (struct dentry *dp = buckets[hash % NR_DCACHE_BUCKETS]; dp != NULL; dp = dp->next) {
+    if (dp->hash == hash && dp->parent == parent && dp->len == len
+        && !strncmp(dp->name, name, len)) {
+      return dp;
+    }
+  }
+  return NULL;
+}
+
+static inline void lru_unlink(struct dentry *dp) {
+  dp->lru_prev->lru_next = dp->lru_next;
+  dp->lru_next->lru_prev = dp->lru_prev;
+}
+
+static inline void lru_push(struct dentry *dp) {
+  dp->lru_prev = &lru;
+  dp->lru_next = lru.lru_next;
+  lru.lru_next->lru_prev = dp;
+  lru.lru_next = dp;
+}
+
+static void bucket_unlink(struct dentry *dp) {
+  struct dentry **pp = &buckets[dp->hash % NR_DCACHE_BUCKETS];
+  while (*pp != dp) pp = &(*pp)->next;
+  *pp = dp->next;
+}
+
+inode_t *dcache_lookup(inode_t *parent, const char *name, size_t len, bool *hit) {
+  *hit = false;
+  if (len >= NR_DCACHE_NAME) return NULL;
+
+  uint32_t hash = dcache_hash(parent, name, len);
+  spinlock_acquire(&dcache_lock);
+  struct dentry *dp = dcache_find(parent, name, len, hash);
+  inode_t *ret = NULL;
+  if (dp) {
+    *hit = true;
+    ret = dp->inode;
+    lru_unlink(dp);
+    lru_push(dp);
+  }
+  spinlock_release(&dcache_lock);
+  return ret;
+}
+
+void dcache_enter(inode_t *parent, const char *name, size_t len, inode_t *inode) {
+  if (len >= NR_DCACHE_NAME) return;
+
+  uint32_t hash = dcache_hash(parent, name, len);
+  spinlock_acquire(&dcache_lock);
+  struct dentry *dp = dcache_find(parent, name, len, hash);
+  if (dp) {
+    lru_unlink(dp);
+  } else {
+    if (nr_dentries < NR_DCACHE_ENTRIES) {
+      dp = pmm->alloc(sizeof(struct dentry));
+      ++nr_dentries;
+    } else {
+      // full, the least recently used entry is reused
+      dp = lru.lru_prev;
+      lru_unlink(dp);
+      bucket_unlink(dp);
+    }
+    dp->parent = parent;
+    dp->hash = hash;
+    dp->len = len;
+    strncpy(dp->name, name, len);
+    dp->name[len] = '\0';
+    dp->next = buckets[hash % NR_DCACHE_BUCKETS];
+    buckets[hash % NR_DCACHE_BUCKETS] = dp;
+  }
+  lru_push(dp);
+  dp->inode = inode;
+  spinlock_release(&dcache_lock);
+}
+
+void dcache_purge(inode_t *inode) {
+  // drop every entry that refers to the inode, either as parent or target
+  spinlock_acquire(&dcache_lock);
+  for (int i = 0; i < NR_DCACHE_BUCKETS; ++i) {
+    struct dentry **pp = &buckets[i];
+    while (*pp) {
+      struct dentry *dp = *pp;
+      if (dp->parent == inode || dp->inode == inode) {
+        *pp = dp->next;
+        lru_unlink(dp);
+        pmm->free(dp);
+        --nr_dentries;
+      } else {
+        pp = &dp->next;
+      }
+    }
+  }
+  spinlock_release(&dcache_lock);
+}
@@ -39,7 +39,6 @@ static device_t *dev_create(size_t dev_size, const char* dev_name, int dev_id, d
 }
 
 void tty_task(void *arg);
-void input_task(void *arg);
 
 #define CREATE(id, device_type, dev_name, dev_id, dev_ops) \
   devices[id] = dev_create(sizeof(device_type), dev_name, dev_id, dev_ops);
@@ -52,7 +51,6 @@ static void dev_init() {
   DEVICES(INIT);
   nr_devices = LENGTH(devices);
 
-  kmt->create(pmm->alloc(sizeof(task_t)), "input-task", input_task, NULL);
   kmt->create(pmm->alloc(sizeof(task_t)), "tty-task", tty_task, NULL);
 }
 
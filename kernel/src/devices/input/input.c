@@ -1,8 +1,16 @@
 #include <devices.h>
 #include <debug.h>
 
-#define NEVENTS 128
-sem_t sem_kbdirq;
+#define NEVENTS 128 // a power of 2, so the free running indices wrap cleanly
+#define NCODES  256 // key codes read by the top half, not yet translated
+
+// the keyboard controller and codes are shared by the interrupt handler
+// and the bottom half, so both go under kbd_lock, which keeps interrupts
+// off while held
+static struct spinlock kbd_lock;
+static int codes[NCODES];
+static uint32_t code_front, code_rear;
+static struct work kbd_work;
 
 static struct input_event event(int ctrl, int alt, int data) {
   return (struct input_event) {
@@ -13,27 +21,34 @@ static struct input_event event(int ctrl, int alt, int data) {
 }
 
 static void push_event(input_t *in, struct input_event ev) {
-  kmt->spin_lock(&in->lock);
-  in->events[in->rear] = ev;
-  in->rear = (in->rear + 1) % NEVENTS;
-  if (in->rear == in->front) { Panic("input queue full"); }
-  //printf("EVENT PUSHED! <<<<<<<<< %d\n", in->rear - in->front);
-  kmt->spin_unlock(&in->lock);
-  kmt->sem_signal(&in->event_sem);
-  //printf("EVENT SIGNAL SENT\n");
+  // only the bottom half pushes, and only once it has seen room
+  Assert(in->rear - in->front < NEVENTS, "input ring is full");
+  uint32_t rear = in->rear;
+  in->events[rear % NEVENTS] = ev;
+  __sync_synchronize(); // the event is in place before it is published
+  in->rear = rear + 1;
+  __sync_synchronize();
+  if (rear == in->front) kmt->sem_signal(&in->event_sem); // was empty
 }
 
-static struct input_event pop_event(input_t *in) {
-  kmt->sem_wait(&in->event_sem);
-  //printf("EVENT SIGNAL CAUGHT\n");
-  kmt->spin_lock(&in->lock);
-  if (in->rear == in->front) { Panic("input queue empty"); }
-  int idx = in->front;
-  in->front = (in->front + 1) % NEVENTS;
-  struct input_event ret = in->events[idx];
-  //printf("EVENT POPED! >>>>>>>>>> %d\n", in->rear - in->front);
-  kmt->spin_unlock(&in->lock);
-  return ret;
+static int pop_events(input_t *in, struct input_event *evs, int n) {
+  // waits for at least one event, then takes up to n of them at once
+  kmt->sem_wait(&in->reader);
+  while (in->rear == in->front) {
+    kmt->sem_wait(&in->event_sem);
+  }
+  uint32_t front = in->front;
+  int nr = in->rear - front;
+  if (nr > n) nr = n;
+  for (int i = 0; i < nr; i++) {
+    evs[i] = in->events[(front + i) % NEVENTS];
+  }
+  __sync_synchronize(); // the slots are read before they are handed back
+  in->front = front + nr;
+  __sync_synchronize();
+  if (in->rear - front == NEVENTS) work_queue(&kbd_work); // was full, codes wait
+  kmt->sem_signal(&in->reader);
+  return nr;
 }
 
 void input_keydown(device_t *dev, int code) {
@@ -84,43 +99,65 @@ void input_keydown(device_t *dev, int code) {
   }
 }
 
+static int kbd_drain() {
+  // moves key codes out of the controller while there is room; what does
+  // not fit stays in the controller until the bottom half drains again
+  int nr = 0, code;
+  spinlock_acquire(&kbd_lock);
+  while (code_rear - code_front < NCODES && (code = read_key()) != 0) {
+    codes[code_rear++ % NCODES] = code;
+    nr++;
+  }
+  spinlock_release(&kbd_lock);
+  return nr;
+}
+
 static _Context *input_notify(_Event ev, _Context *context) {
-  kmt->sem_signal(&sem_kbdirq);
+  // top half, only saves the codes
+  kbd_drain();
+  work_queue(&kbd_work);
   return NULL;
 }
 
-void input_task(void *args) {
-  device_t *in = dev_lookup("input");
-
-  while (1) {
-    int code;
-    while ((code = read_key()) != 0) {
-      input_keydown(in, code);
+static void input_bottom_half(struct work *work) {
+  // translates the codes into events; a work item must not wait, so on a
+  // full ring the codes stay where they are until the reader makes room
+  // and queues this again. A code makes at most one event
+  device_t *dev = work->arg;
+  input_t *in = dev->ptr;
+  do {
+    while (1) {
+      if (in->rear - in->front == NEVENTS) return;
+      spinlock_acquire(&kbd_lock);
+      bool empty = code_front == code_rear;
+      int code = empty ? 0 : codes[code_front++ % NCODES];
+      spinlock_release(&kbd_lock);
+      if (empty) break;
+      input_keydown(dev, code);
     }
-    kmt->sem_wait(&sem_kbdirq);
-  }
+  } while (kbd_drain() > 0);
 }
 
 static int input_init(device_t *dev) {
   input_t *in = dev->ptr;
   in->events = pmm->alloc(sizeof(in->events[0]) * NEVENTS);
   in->front = in->rear = 0;
-  kmt->spin_init(&in->lock, "/dev/input lock");
   kmt->sem_init(&in->event_sem, "events in queue", 0);
-  kmt->sem_init(&sem_kbdirq, "keyboard-interrupt", 0);
+  kmt->sem_init(&in->reader, "/dev/input reader", 1);
+  spinlock_init(&kbd_lock, "keyboard");
+  code_front = code_rear = 0;
+  work_init(&kbd_work, input_bottom_half, dev);
 
   os->on_irq(0, _EVENT_IRQ_IODEV, input_notify);
+  work_queue(&kbd_work); // keys pressed before the handler was in place
   return 0;
 }
 
 static ssize_t input_read(device_t *dev, off_t offset, void *buf, size_t count) {
-  struct input_event ev = pop_event(dev->ptr);
-  if (count >= sizeof(ev)) {
-    memcpy(buf, &ev, sizeof(ev));
-    return sizeof(ev);
-  } else {
-    return 0;
-  }
+  // as many whole events as fit in buf
+  int n = count / sizeof(struct input_event);
+  if (n == 0) return 0;
+  return pop_events(dev->ptr, buf, n) * sizeof(struct input_event);
 }
 
 static ssize_t input_write(device_t *dev, off_t offset, const void *buf, size_t count) {
@@ -2,33 +2,120 @@
 
 extern char initrd_start, initrd_end;
 
-int rd_init(device_t *dev) {
-  rd_t *rd = dev->ptr;
-  if (dev->id == 1) {
-    rd->start = &initrd_start;
-    rd->end   = &initrd_end;
-  } else {
-    char *space = pmm->alloc(RD_SIZE);
-    rd->start = space;
-    rd->end   = space + RD_SIZE;
+static char *rd_page(rd_t *rd, off_t offset, bool alloc) {
+  // backing page of a lazily backed disk, NULL while it was never written
+  char **pp = &rd->pages[offset / RD_PAGE_SIZE];
+  if (*pp == NULL && alloc) {
+    char *page = pmm->alloc(RD_PAGE_SIZE);
+    spinlock_acquire(&rd->lock);
+    if (*pp == NULL) {
+      *pp = page;
+      page = NULL;
+    }
+    spinlock_release(&rd->lock);
+    if (page) pmm->free(page);
   }
-  return 0;
+  return *pp;
+}
+
+off_t rd_size(device_t *dev) {
+  rd_t *rd = dev->ptr;
+  return rd->pages ? rd->size : rd->end - rd->start;
 }
 
 ssize_t rd_read(device_t *dev, off_t offset, void *buf, size_t count) {
   rd_t *rd = dev->ptr;
-  memcpy(buf, ((char *)rd->start) + offset, count);
+  off_t size = rd_size(dev);
+  if (offset >= size) return 0;
+  if (count > size - offset) count = size - offset;
+  if (!rd->pages) {
+    memcpy(buf, ((char *)rd->start) + offset, count);
+    return count;
+  }
+  for (size_t done = 0; done < count; ) {
+    size_t in = (offset + done) % RD_PAGE_SIZE;
+    size_t len = RD_PAGE_SIZE - in;
+    if (len > count - done) len = count - done;
+    char *page = rd_page(rd, offset + done, false);
+    if (page) {
+      memcpy((char *)buf + done, page + in, len);
+    } else {
+      memset((char *)buf + done, 0, len);
+    }
+    done += len;
+  }
   return count;
 }
 
 ssize_t rd_write(device_t *dev, off_t offset, const void *buf, size_t count) {
   rd_t *rd = dev->ptr;
-  memcpy(((char *)rd->start) + offset, buf, count);
+  off_t size = rd_size(dev);
+  if (offset >= size) return 0;
+  if (count > size - offset) count = size - offset;
+  if (!rd->pages) {
+    memcpy(((char *)rd->start) + offset, buf, count);
+    return count;
+  }
+  for (size_t done = 0; done < count; ) {
+    size_t in = (offset + done) % RD_PAGE_SIZE;
+    size_t len = RD_PAGE_SIZE - in;
+    if (len > count - done) len = count - done;
+    memcpy(rd_page(rd, offset + done, true) + in, (const char *)buf + done, len);
+    done += len;
+  }
   return count;
 }
 
+void *rd_map(device_t *dev, off_t offset, size_t *count) {
+  // pages never written map to a shared zero page instead of being allocated
+  static const char zeros[RD_PAGE_SIZE] = {};
+  rd_t *rd = dev->ptr;
+  off_t size = rd_size(dev);
+  if (offset >= size) return NULL;
+  if (*count > size - offset) *count = size - offset;
+  if (!rd->pages) return rd->start + offset;
+  size_t in = offset % RD_PAGE_SIZE;
+  if (*count > RD_PAGE_SIZE - in) *count = RD_PAGE_SIZE - in;
+  char *page = rd_page(rd, offset, false);
+  return (page ? page : (char *)zeros) + in;
+}
+
+static int rd_request(blkdev_t *bdev, struct request *rq) {
+  // memory has no seek cost, so a merged request is just its bios in turn
+  device_t *dev = bdev->ptr;
+  off_t offset = (off_t)rq->sector * BLK_SECTOR_SIZE;
+  for (struct bio *bio = rq->head; bio != NULL; bio = bio->next) {
+    size_t count = bio->nr_sectors * BLK_SECTOR_SIZE;
+    if (bio->op == BIO_READ) {
+      rd_read(dev, offset, bio->buf, count);
+    } else {
+      rd_write(dev, offset, bio->buf, count);
+    }
+    offset += count;
+  }
+  return 0;
+}
+
+int rd_init(device_t *dev) {
+  // the initrd is used in place, other disks get pages as they are written
+  rd_t *rd = dev->ptr;
+  if (dev->id == 1) {
+    rd->start = &initrd_start;
+    rd->end   = &initrd_end;
+  } else {
+    rd->size  = RD_SIZE;
+    rd->pages = pmm->alloc(RD_SIZE / RD_PAGE_SIZE * sizeof(char *));
+    spinlock_init(&rd->lock, dev->name);
+  }
+  dev->blk = pmm->alloc(sizeof(blkdev_t));
+  blk_init(dev->blk, dev->name, rd_size(dev), rd_request, dev);
+  return 0;
+}
+
 devops_t rd_ops = {
   .init = rd_init,
   .read = rd_read,
   .write = rd_write,
+  .size = rd_size,
+  .map = rd_map,
 };
@@ -3,6 +3,8 @@
 
 #define TTY_COOK_BUF_SZ 1024
 
+static struct work tty_refresh; // queued when a clean tty gets dirty
+
 struct character tty_defaultch() {
   return (struct character) { .metadata = 0, .ch = '\0' };
 }
@@ -10,154 +12,232 @@ struct character tty_defaultch() {
 // tty state changes
 // ------------------------------------------------------------------
 
-static void tty_enqueue(struct tty_queue *q, char ch) {
-  *(q->rear++) = ch;
-  if (q->rear == q->end) {
-    q->rear = q->buf;
-  }
-  if (q->rear == q->front) panic("tty queue full");
-  *q->rear = '\0';
+static int tty_enqueue(struct tty_queue *q, char ch, int reserve) {
+  // keeps reserve bytes free, so a line being edited can always be ended;
+  // a full queue drops ch and returns 1
+  if (q->size - (q->tail - q->head) <= reserve) return 1;
+  q->buf[q->tail++ % q->size] = ch;
+  return 0;
 }
 
 static int tty_pop_back(struct tty_queue *q) {
-  if (q->front != q->end) {
-    char *pos = q->rear;
-    if (pos == q->buf) pos = q->end;
-    if (*(pos - 1) != '\0') {
-      q->rear = pos - 1;
-      *q->rear = '\0';
-      return 0;
-    }
-  }
-  return 1;
+  if (q->tail == q->cooked) return 1;
+  q->tail--;
+  return 0;
+}
+
+static inline struct character *tty_line(tty_t *tty, int y) {
+  // y counts screen lines, negative ones are history
+  return &tty->buf[((tty->top + y) % tty->rows + tty->rows) % tty->rows * tty->columns];
 }
 
 static void tty_upd_scrollup(tty_t *tty) {
-   int move_sz = tty->columns * (tty->lines - 1);
-   memmove(tty->buf, tty->buf + tty->columns, move_sz * sizeof(tty->buf[0]));
-   memmove(tty->dirty, tty->dirty + tty->columns, move_sz * sizeof(tty->dirty[0]));
-   tty->cursor -= tty->columns;
-   for (int i = 0; i < tty->columns; i++) {
-     tty->cursor[i] = tty_defaultch();
-   }
+  // the oldest history line becomes the new bottom line
+  tty->top = (tty->top + 1) % tty->rows;
+  if (tty->history < tty->rows - tty->lines) tty->history++;
+  struct character *line = tty_line(tty, tty->lines - 1);
+  for (int i = 0; i < tty->columns; i++) {
+    line[i] = tty_defaultch();
+  }
+  tty->cur_y--;
 }
 
 static inline void tty_upd_cr(tty_t *tty) {
-  int x = (tty->cursor - tty->buf) % tty->columns;
-  tty->cursor -= x;
+  tty->cur_x = 0;
 }
 
 static inline void tty_upd_lf(tty_t *tty) {
-  tty->cursor += tty->columns;
+  tty->cur_y++;
 }
 
 static inline void tty_upd_backsp(tty_t *tty) {
-  if (tty->cursor > tty->buf) {
-    tty->cursor--;
-    tty->cursor->ch = '\0';
+  if (tty->cur_x > 0) {
+    tty->cur_x--;
+  } else if (tty->cur_y > 0) {
+    tty->cur_y--;
+    tty->cur_x = tty->columns - 1;
+  } else {
+    return;
   }
+  tty_line(tty, tty->cur_y)[tty->cur_x].ch = '\0';
 }
 
 static inline void tty_upd_putc(tty_t *tty, char ch) {
-  tty->cursor->ch = ch;
-  tty->cursor++;
+  tty_line(tty, tty->cur_y)[tty->cur_x].ch = ch;
+  if (++tty->cur_x == tty->columns) {
+    tty->cur_x = 0;
+    tty->cur_y++;
+  }
 }
 
 static int tty_cook(tty_t *tty, char ch) {
+  // returns 0 if ch is to be echoed
   int ret = 0;
   kmt->sem_wait(&tty->lock);
   struct tty_queue *q = &tty->queue;
-  switch (ch) {
-    case '\n':
-      tty_enqueue(q, ch);
-      tty_enqueue(q, '\0');
-      kmt->sem_signal(&tty->cooked);
-      break;
-    case '\b':
-      ret = tty_pop_back(q);
-      break;
-    default:
-      tty_enqueue(q, ch);
+  int cooked = q->cooked;
+  if (tty->mode & TTY_RAW) {
+    ret = 1;
+    if (tty_enqueue(q, ch, 0) == 0) q->cooked = q->tail;
+  } else {
+    switch (ch) {
+      case '\n':
+        ret = tty_enqueue(q, ch, 0);
+        if (ret == 0) q->cooked = q->tail;
+        break;
+      case '\b':
+        ret = tty_pop_back(q);
+        break;
+      default:
+        ret = tty_enqueue(q, ch, 1);
+    }
   }
+  bool wake = q->cooked != cooked;
   kmt->sem_signal(&tty->lock);
+  if (wake) kmt->sem_signal(&tty->cooked);
   return ret;
 }
 
 // tty marking
 // ------------------------------------------------------------------
 
+static inline bool tty_dirty(tty_t *tty) {
+  return tty->dirty_top < tty->dirty_bot;
+}
+
 static void tty_render(tty_t *tty) {
-  struct character *ch = tty->buf;
-  uint8_t *d = tty->dirty;
+  // every cell between the first and the last dirty one goes to its two
+  // sprite slots in a single write, the fb redraws the ones that changed;
+  // a tty renders whether or not its display is shown
   kmt->sem_wait(&tty->lock);
-  for (int y = 0; y < tty->lines; y++) {
-    for (int x = 0; x < tty->columns; x++) {
-      if (*d) {
-        int draw = (ch == tty->cursor) ? 0xdb : ch->ch;
-        struct sprite sp[2] = {
-          { .x = x * 8, .y = y * 16, .z = 0,
-            .display = tty->display, .texture = draw * 2 + 1, },
-          { .x = x * 8, .y = y * 16 + 8, .z = 0,
-            .display = tty->display, .texture = draw * 2 + 2, },
-        };
-        tty->fbdev->ops->write(tty->fbdev, SPRITE_BRK, &sp, sizeof(sp));
-        }
-      ch++; d++;
+  if (tty_dirty(tty)) {
+    if (tty->scrolled) {
+      // two sprite slots per cell, so a line is 2 * columns slots
+      struct fb_scroll sc = { .display = tty->display,
+        .dy = tty->scrolled * 16, .slots = 2 * tty->columns * tty->scrolled };
+      tty->fbdev->ops->ioctl(tty->fbdev, FB_SCROLL, &sc);
+      tty->scrolled = 0;
+    }
+    int first = tty->dirty_top * tty->columns + tty->dirty[tty->dirty_top].lo;
+    int last = (tty->dirty_bot - 1) * tty->columns + tty->dirty[tty->dirty_bot - 1].hi;
+    struct sprite *sp = tty->batch;
+    for (int i = first; i < last; i++) {
+      int y = i / tty->columns, x = i % tty->columns;
+      bool cursor = y == tty->cur_y + tty->view && x == tty->cur_x;
+      int draw = cursor ? 0xdb : tty_line(tty, y - tty->view)[x].ch;
+      *sp++ = (struct sprite) { .x = x * 8, .y = y * 16, .z = 0,
+        .display = tty->display, .texture = draw * 2 + 1, };
+      *sp++ = (struct sprite) { .x = x * 8, .y = y * 16 + 8, .z = 0,
+        .display = tty->display, .texture = draw * 2 + 2, };
     }
+    for (int y = tty->dirty_top; y < tty->dirty_bot; y++) {
+      tty->dirty[y] = (struct tty_span) { .lo = tty->columns, .hi = 0 };
+    }
+    tty->dirty_top = tty->lines;
+    tty->dirty_bot = 0;
+    tty->fbdev->ops->write(tty->fbdev, SPRITE_BRK + 2 * first * sizeof(*sp),
+        tty->batch, (sp - tty->batch) * sizeof(*sp));
   }
   kmt->sem_signal(&tty->lock);
 }
 
-static void tty_mark(tty_t *tty, struct character *ch) {
-  tty->dirty[ch - tty->buf] = 1;
+static void tty_mark_span(tty_t *tty, int y, int lo, int hi) {
+  if (y < 0 || y >= tty->lines) return;
+  struct tty_span *d = &tty->dirty[y];
+  if (lo < d->lo) d->lo = lo;
+  if (hi > d->hi) d->hi = hi;
+  if (y < tty->dirty_top) tty->dirty_top = y;
+  if (y + 1 > tty->dirty_bot) tty->dirty_bot = y + 1;
 }
 
-static void tty_mark_line(tty_t *tty, struct character *ch) {
-  int x = (ch - tty->buf) % tty->columns;
-  for (int i = 0; i < tty->columns; i++)
-    tty_mark(tty, ch - x + i);
+static inline void tty_mark(tty_t *tty, int y, int x) {
+  tty_mark_span(tty, y, x, x + 1);
 }
 
 static void tty_mark_all(tty_t *tty) {
-   for (int i = 0; i < tty->size; i++) {
-     tty_mark(tty, &tty->buf[i]);
-   }
+  // every cell gets sent, so a pending scroll would be wasted
+  for (int y = 0; y < tty->lines; y++) {
+    tty_mark_span(tty, y, 0, tty->columns);
+  }
+  tty->scrolled = 0;
+}
+
+static void tty_mark_scroll(tty_t *tty) {
+  // the screen moved up a line: pending marks move along, the fb moves the
+  // pixels on the next render and only the new bottom line is drawn; once
+  // every cell is dirty anyway, moving the pixels first is wasted work
+  bool all = true;
+  for (int y = 0; y + 1 < tty->lines; y++) {
+    tty->dirty[y] = tty->dirty[y + 1];
+    all = all && tty->dirty[y].lo == 0 && tty->dirty[y].hi == tty->columns;
+  }
+  tty->dirty[tty->lines - 1] = (struct tty_span) { .lo = tty->columns, .hi = 0 };
+  if (tty->dirty_top > 0) tty->dirty_top--;
+  if (tty->dirty_bot > 0) tty->dirty_bot--;
+  tty_mark_span(tty, tty->lines - 1, 0, tty->columns);
+  if (all) {
+    tty->scrolled = 0;
+  } else if (++tty->scrolled == tty->lines) {
+    tty_mark_all(tty);
+  }
 }
 
 // tty implementation
 // ------------------------------------------------------------------
 
 static void tty_putc(tty_t *tty, char ch) {
+  // only the cells under the old and the new cursor change, plus the new
+  // bottom line when the screen scrolls; unchanged cells are not redrawn
+  tty_mark(tty, tty->cur_y + tty->view, tty->cur_x);
   switch (ch) {
     case '\r':
       tty_upd_cr(tty);
-      tty_mark_line(tty, tty->cursor);
       break;
     case '\b':
       tty_upd_backsp(tty);
-      tty_mark(tty, tty->cursor);
-      tty_mark(tty, tty->cursor + 1);
       break;
     case '\n':
       tty_upd_cr(tty);
       tty_upd_lf(tty);
-      if (tty->cursor == tty->end) {
-        tty_upd_scrollup(tty);
-        tty_mark_all(tty);
-      } else {
-        tty_mark_line(tty, tty->cursor - tty->columns);
-        tty_mark_line(tty, tty->cursor);
-      }
       break;
     default:
       tty_upd_putc(tty, ch);
-      if (tty->cursor == tty->end) {
-        tty_upd_scrollup(tty);
-        tty_mark_all(tty);
-      } else {
-        tty_mark(tty, tty->cursor - 1);
-        tty_mark(tty, tty->cursor);
-      }
+  }
+  if (tty->cur_y == tty->lines) {
+    tty_upd_scrollup(tty);
+    tty_mark_scroll(tty);
+  }
+  tty_mark(tty, tty->cur_y + tty->view, tty->cur_x);
+}
+
+static void tty_show(tty_t *tty) {
+  // makes tty the current display, the fb keeps what it shows
+  struct display_info info = {
+    .current = tty->display,
+  };
+  tty->fbdev->ops->write(tty->fbdev, 0, &info, sizeof(struct display_info));
+}
+
+static void tty_scroll_view(tty_t *tty, int delta) {
+  // moves the view into the history by delta lines, 0 is the live screen
+  kmt->sem_wait(&tty->lock);
+  int view = tty->view + delta;
+  if (view > tty->history) view = tty->history;
+  if (view < 0) view = 0;
+  if (view != tty->view) {
+    tty->view = view;
+    tty_mark_all(tty);
+  }
+  kmt->sem_signal(&tty->lock);
+  tty_render(tty);
+}
+
+static void tty_refresh_all(struct work *work) {
+  extern int nr_devices;
+  extern device_t *devices[];
+  extern devops_t tty_ops;
+  for (int i = 0; i < nr_devices; i++) {
+    if (devices[i]->ops == &tty_ops) tty_render(devices[i]->ptr);
   }
 }
 
@@ -169,105 +249,196 @@ int tty_init(device_t *dev) {
   tty->lines = fb->info->height / 16;
   tty->columns = fb->info->width / 8;
   tty->size = tty->columns * tty->lines;
-  tty->buf = pmm->alloc(tty->size * sizeof(tty->buf[0]));
-  tty->dirty = pmm->alloc(tty->size * sizeof(tty->dirty[0]));
-  tty->end = tty->buf + tty->size;
-  for (int i = 0; i < tty->size; i++) {
+  tty->rows = tty->lines + TTY_HISTORY;
+  tty->top = tty->history = tty->view = 0;
+  tty->buf = pmm->alloc(tty->rows * tty->columns * sizeof(tty->buf[0]));
+  tty->dirty = pmm->alloc(tty->lines * sizeof(tty->dirty[0]));
+  tty->batch = pmm->alloc(2 * tty->size * sizeof(tty->batch[0]));
+  for (int i = 0; i < tty->rows * tty->columns; i++) {
     tty->buf[i] = tty_defaultch();
-    tty->dirty[i] = 1;
   }
-  tty->cursor = tty->buf;
+  tty->dirty_top = tty->lines;
+  tty->dirty_bot = 0;
+  tty->scrolled = 0;
+  for (int y = 0; y < tty->lines; y++) {
+    tty->dirty[y] = (struct tty_span) { .lo = tty->columns, .hi = 0 };
+  }
+  tty_mark_all(tty);
+  tty->cur_x = tty->cur_y = 0;
   struct tty_queue *q = &tty->queue;
-  q->front = q->rear = q->buf = pmm->alloc(TTY_COOK_BUF_SZ);
-  q->end = q->buf + TTY_COOK_BUF_SZ;
+  q->buf = pmm->alloc(TTY_COOK_BUF_SZ);
+  q->size = TTY_COOK_BUF_SZ;
+  q->head = q->cooked = q->tail = 0;
+  tty->mode = 0;
   kmt->sem_init(&tty->lock, "tty lock", 1);
-  kmt->sem_init(&tty->cooked, "tty cooked lines", 0);
+  kmt->sem_init(&tty->cooked, "tty input ready", 0);
+  if (dev->id == 1) work_init(&tty_refresh, tty_refresh_all, NULL);
   return 0;
 }
 
 ssize_t tty_read(device_t *dev, off_t offset, void *buf, size_t count) {
+  // returns as many whole lines as fit in buf, or the start of a line
+  // longer than buf; in raw mode whatever input there is
   tty_t *tty = dev->ptr;
-  kmt->sem_wait(&tty->cooked);
+  if (count == 0) return 0;
+  tty_render(tty); // whatever was written before waiting shows up now
   kmt->sem_wait(&tty->lock);
-  size_t nread = 0;
-
   struct tty_queue *q = &tty->queue;
-  while (1) {
-    char ch = *q->front;
-    if (nread < count && ch != '\0') {
-      ((char *)buf)[nread] = *q->front;
+  while (q->head == q->cooked) {
+    if (tty->mode & TTY_NONBLOCK) {
+      kmt->sem_signal(&tty->lock);
+      return E_AGAIN;
     }
-    q->front++;
-    if (q->front == q->end) q->front = q->buf;
-    if (ch == '\0') break;
-    nread++;
+    kmt->sem_signal(&tty->lock);
+    kmt->sem_wait(&tty->cooked);
+    kmt->sem_wait(&tty->lock);
   }
+
+  int nread = q->cooked - q->head;
+  if ((size_t)nread > count) {
+    nread = count;
+    if (!(tty->mode & TTY_RAW)) {
+      int end = nread;
+      while (end > 0 && q->buf[(q->head + end - 1) % q->size] != '\n') end--;
+      if (end > 0) nread = end;
+    }
+  }
+  int at = q->head % q->size;
+  int len = (at + nread > q->size) ? q->size - at : nread;
+  memcpy(buf, q->buf + at, len);
+  memcpy((char *)buf + len, q->buf, nread - len);
+  q->head += nread;
+  if (q->head >= q->size) {
+    q->head -= q->size;
+    q->cooked -= q->size;
+    q->tail -= q->size;
+  }
+  bool more = q->head != q->cooked;
   kmt->sem_signal(&tty->lock);
+  if (more) kmt->sem_signal(&tty->cooked); // for the next reader
   return nread;
 }
 
-ssize_t tty_write(device_t *dev, off_t offset, const void *buf, size_t count) {
+static int tty_setmode(tty_t *tty, const struct tty_mode *mode) {
+  struct tty_queue *q = &tty->queue;
+  if (mode->qsize != 0 && mode->qsize != q->size) {
+    // the ring is unrolled into the new buffer
+    if (mode->qsize < 2 || mode->qsize <= q->tail - q->head) return E_TOOLG;
+    char *buf = pmm->alloc(mode->qsize);
+    for (int i = q->head; i < q->tail; i++) {
+      buf[i - q->head] = q->buf[i % q->size];
+    }
+    pmm->free(q->buf);
+    q->buf = buf;
+    q->size = mode->qsize;
+    q->cooked -= q->head;
+    q->tail -= q->head;
+    q->head = 0;
+  }
+  tty->mode = mode->flags;
+  if (tty->mode & TTY_RAW) q->cooked = q->tail; // the pending line is input now
+  return 0;
+}
+
+int tty_ioctl(device_t *dev, int request, void *arg) {
   tty_t *tty = dev->ptr;
+  struct tty_mode *mode = arg;
+  int ret = 0;
   kmt->sem_wait(&tty->lock);
-  for (size_t i = 0; i < count; i++) {
-    tty_putc(tty, ((const char *)buf)[i]);
+  int cooked = tty->queue.cooked;
+  switch (request) {
+    case TTY_GETMODE:
+      mode->flags = tty->mode;
+      mode->qsize = tty->queue.size;
+      break;
+    case TTY_SETMODE:
+      ret = tty_setmode(tty, mode);
+      break;
+    default:
+      ret = E_BADTP;
   }
+  bool wake = tty->queue.cooked != cooked;
   kmt->sem_signal(&tty->lock);
-  tty_render(tty);
-  return count;
+  if (wake) kmt->sem_signal(&tty->cooked);
+  return ret;
+}
+
+ssize_t tty_writev(device_t *dev, off_t offset, const struct iovec *iov, int iovcnt) {
+  // only updates the buffer, tty-refresh renders once for everything
+  // written in the meantime
+  tty_t *tty = dev->ptr;
+  ssize_t nwrite = 0;
+  kmt->sem_wait(&tty->lock);
+  bool clean = !tty_dirty(tty);
+  if (tty->view) {
+    // output brings a scrolled back view to the live screen
+    tty->view = 0;
+    tty_mark_all(tty);
+  }
+  for (int i = 0; i < iovcnt; i++) {
+    for (size_t j = 0; j < iov[i].iov_len; j++) {
+      tty_putc(tty, ((const char *)iov[i].iov_base)[j]);
+    }
+    nwrite += iov[i].iov_len;
+  }
+  bool kick = clean && tty_dirty(tty);
+  kmt->sem_signal(&tty->lock);
+  if (kick) work_queue(&tty_refresh);
+  return nwrite;
+}
+
+ssize_t tty_write(device_t *dev, off_t offset, const void *buf, size_t count) {
+  struct iovec iov = { (void *)buf, count };
+  return tty_writev(dev, offset, &iov, 1);
 }
 
 devops_t tty_ops = {
   .init = tty_init,
   .read = tty_read,
   .write = tty_write,
+  .writev = tty_writev,
+  .ioctl = tty_ioctl,
 };
 
 void tty_task(void *arg) {
   device_t *in = dev_lookup("input");
   device_t *ttydev = dev_lookup("tty1");
-  device_t *fb = dev_lookup("fb");
 
   tty_render(ttydev->ptr);
   while (1) {
-    struct input_event ev;
-    int nread = in->ops->read(in, 0, &ev, sizeof(ev));
-    if (nread > 0) {
-      if (ev.alt) {
+    struct input_event evs[32];
+    int nread = in->ops->read(in, 0, evs, sizeof(evs));
+    if (nread <= 0) panic("error");
+    for (struct input_event *ev = evs; ev < evs + nread / sizeof(evs[0]); ev++) {
+      if (ev->alt) {
         device_t *next = ttydev;
-        if (ev.data == '1') next = dev_lookup("tty1");
-        if (ev.data == '2') next = dev_lookup("tty2");
-        if (ev.data == '3') next = dev_lookup("tty3");
-        if (ev.data == '4') next = dev_lookup("tty4");
-        if (ev.data == '7') {
+        if (ev->data == '1') next = dev_lookup("tty1");
+        if (ev->data == '2') next = dev_lookup("tty2");
+        if (ev->data == '3') next = dev_lookup("tty3");
+        if (ev->data == '4') next = dev_lookup("tty4");
+        if (ev->data == '7') {
           printf("Switch to terminal\n");
         }
         if (next != ttydev) {
           ttydev = next;
-          tty_t *tty = ttydev->ptr;
-
-          struct display_info info = {
-            .current = tty->display,
-          };
-          tty_mark_all(tty);
-          fb->ops->write(fb, 0, &info, sizeof(struct display_info));
-          ttydev->ops->write(ttydev, 0, "", 0);
+          tty_show(ttydev->ptr);
         }
+        tty_t *tty = ttydev->ptr;
+        if (ev->data == 'u') tty_scroll_view(tty, tty->lines / 2);
+        if (ev->data == 'd') tty_scroll_view(tty, -tty->lines / 2);
       }
-      if (ev.ctrl) {
-        if (ev.data == 'c') {
+      if (ev->ctrl) {
+        if (ev->data == 'c') {
           printf("Ctrl - c\n");
         }
       }
-      if (!ev.ctrl && !ev.alt) {
-        char ch = ev.data;
+      if (!ev->ctrl && !ev->alt) {
+        char ch = ev->data;
         tty_t *tty = ttydev->ptr;
         if (tty_cook(tty, ch) == 0) {
           ttydev->ops->write(ttydev, 0, &ch, 1);
         }
       }
-    } else {
-      panic("error");
     }
   }
 }
@@ -2,6 +2,7 @@
 
 #define NTEXTURE 16384
 #define NSPRITE  16384
+#define NZ       (1 << 12) // z is 12 bits
 
 static sem_t fb_sem;
 extern uint8_t TERM_FONT[];
@@ -26,7 +27,6 @@ int fb_init(device_t *dev) {
   fb_t *fb = dev->ptr;
   fb->info = pmm->alloc(sizeof(struct display_info));
   fb->textures = pmm->alloc(sizeof(struct texture) * NTEXTURE);
-  fb->sprites = pmm->alloc(sizeof(struct sprite) * NSPRITE);
   *(fb->info) = (struct display_info) {
     .width = screen_width(),
     .height = screen_height(),
@@ -35,50 +35,315 @@ int fb_init(device_t *dev) {
     .num_sprites = NSPRITE,
     .current = 0,
   };
+  fb->displays = pmm->alloc(sizeof(struct fb_display) * fb->info->num_displays);
+  fb->tiles_w = (fb->info->width + TEXTURE_W - 1) / TEXTURE_W;
+  fb->tiles_h = (fb->info->height + TEXTURE_H - 1) / TEXTURE_H;
+  fb->order = pmm->alloc(sizeof(int) * NSPRITE);
+  fb->zcount = pmm->alloc(sizeof(int) * NZ);
+  fb->rects = pmm->alloc(sizeof(_DEV_VIDEO_RECT_t) * fb->tiles_h);
   kmt->sem_init(&fb_sem, dev->name, 1);
   font_load(fb, TERM_FONT);
   return 0;
 }
 
+static struct fb_display *fb_display(fb_t *fb, int id) {
+  struct fb_display *ds = &fb->displays[id];
+  if (!ds->sprites) {
+    ds->sprites = pmm->alloc(sizeof(struct sprite) * NSPRITE);
+    ds->back = pmm->alloc(fb->info->width * fb->info->height * sizeof(uint32_t));
+    ds->dirty = pmm->alloc(fb->tiles_w * fb->tiles_h);
+  }
+  return ds;
+}
+
 ssize_t fb_read(device_t *dev, off_t offset, void *buf, size_t count) {
   fb_t *fb = dev->ptr;
   if (offset != 0) return 0;
   if (count != sizeof(struct display_info)) return 0;
   memcpy(buf, fb->info, sizeof(struct display_info));
+  return count;
+}
+
+// composition
+// ------------------------------------------------------------------
+
+static void fb_mark(fb_t *fb, struct fb_display *ds, const struct sprite *sp) {
+  // the tiles under sp have to be composed again
+  if (sp->texture == 0) return;
+  if (sp->x >= fb->info->width || sp->y >= fb->info->height) return;
+  int tx1 = (sp->x + TEXTURE_W - 1) / TEXTURE_W, ty1 = (sp->y + TEXTURE_H - 1) / TEXTURE_H;
+  if (tx1 >= fb->tiles_w) tx1 = fb->tiles_w - 1;
+  if (ty1 >= fb->tiles_h) ty1 = fb->tiles_h - 1;
+  for (int ty = sp->y / TEXTURE_H; ty <= ty1; ty++) {
+    for (int tx = sp->x / TEXTURE_W; tx <= tx1; tx++) {
+      ds->dirty[ty * fb->tiles_w + tx] = 1;
+    }
+  }
+  ds->changed = true;
+}
+
+static const int *fb_sort(fb_t *fb, struct fb_display *ds) {
+  // stable counting sort of the used slots by z, so equal z keep the slot
+  // order; NULL if the slots are in order already
+  struct sprite *sp = ds->sprites;
+  int n = ds->nr_used;
+  bool sorted = true;
+  for (int i = 1; i < n && sorted; i++) {
+    sorted = sp[i - 1].z <= sp[i].z;
+  }
+  if (sorted) return NULL;
+
+  memset(fb->zcount, 0, sizeof(int) * NZ);
+  for (int i = 0; i < n; i++) fb->zcount[sp[i].z]++;
+  for (int z = 0, sum = 0; z < NZ; z++) {
+    int cnt = fb->zcount[z];
+    fb->zcount[z] = sum;
+    sum += cnt;
+  }
+  for (int i = 0; i < n; i++) {
+    fb->order[fb->zcount[sp[i].z]++] = i;
+  }
+  return fb->order;
+}
+
+static void fb_draw(fb_t *fb, struct fb_display *ds, const struct sprite *sp) {
+  // copies the parts of sp that lie on dirty tiles into the back buffer
+  int W = fb->info->width, H = fb->info->height;
+  if (sp->x >= W || sp->y >= H) return;
+  const uint32_t *pixels = fb->textures[sp->texture].pixels;
+  int tx1 = (sp->x + TEXTURE_W - 1) / TEXTURE_W, ty1 = (sp->y + TEXTURE_H - 1) / TEXTURE_H;
+  for (int ty = sp->y / TEXTURE_H; ty <= ty1 && ty < fb->tiles_h; ty++) {
+    for (int tx = sp->x / TEXTURE_W; tx <= tx1 && tx < fb->tiles_w; tx++) {
+      if (!ds->dirty[ty * fb->tiles_w + tx]) continue;
+      // sprite and tile intersect in [x0, x1) x [y0, y1)
+      int x0 = tx * TEXTURE_W, y0 = ty * TEXTURE_H;
+      int x1 = x0 + TEXTURE_W, y1 = y0 + TEXTURE_H;
+      if (x0 < sp->x) x0 = sp->x;
+      if (y0 < sp->y) y0 = sp->y;
+      if (x1 > sp->x + TEXTURE_W) x1 = sp->x + TEXTURE_W;
+      if (y1 > sp->y + TEXTURE_H) y1 = sp->y + TEXTURE_H;
+      if (x1 > W) x1 = W;
+      if (y1 > H) y1 = H;
+      const uint32_t *src = &pixels[(y0 - sp->y) * TEXTURE_W + (x0 - sp->x)];
+      uint32_t *dst = &ds->back[y0 * W + x0];
+      for (int y = y0; y < y1; y++, src += TEXTURE_W, dst += W) {
+        if (x1 - x0 == TEXTURE_W) {
+          dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = src[3];
+          dst[4] = src[4]; dst[5] = src[5]; dst[6] = src[6]; dst[7] = src[7];
+        } else {
+          for (int i = 0; i < x1 - x0; i++) dst[i] = src[i];
+        }
+      }
+    }
+  }
+}
+
+static void fb_blit(fb_t *fb, struct fb_display *ds, _DEV_VIDEO_RECT_t *rects, int nr) {
+  _DEV_VIDEO_BLIT_t ctl = {
+    .pixels = ds->back,
+    .pitch = fb->info->width,
+    .nr = nr,
+    .rects = rects,
+  };
+  _io_write(_DEV_VIDEO, _DEVREG_VIDEO_BLIT, &ctl, sizeof(ctl));
+}
+
+static int fb_redraw(fb_t *fb, struct fb_display *ds) {
+  // dirty tiles are cleared and every sprite over them is drawn again in
+  // z order; returns how many rects in fb->rects cover them
+  int W = fb->info->width, H = fb->info->height;
+
+  for (int ty = 0; ty < fb->tiles_h; ty++) {
+    for (int tx = 0; tx < fb->tiles_w; tx++) {
+      if (!ds->dirty[ty * fb->tiles_w + tx]) continue;
+      int w = (tx * TEXTURE_W + TEXTURE_W > W) ? W - tx * TEXTURE_W : TEXTURE_W;
+      uint32_t *dst = &ds->back[ty * TEXTURE_H * W + tx * TEXTURE_W];
+      for (int y = ty * TEXTURE_H; y < ty * TEXTURE_H + TEXTURE_H && y < H; y++, dst += W) {
+        memset(dst, 0, w * sizeof(uint32_t));
+      }
+    }
+  }
+
+  const int *order = fb_sort(fb, ds);
+  for (int i = 0; i < ds->nr_used; i++) {
+    const struct sprite *sp = &ds->sprites[order ? order[i] : i];
+    if (sp->texture > 0) fb_draw(fb, ds, sp);
+  }
+
+  // one rect per run of tile rows with the same dirty columns
+  int nr = 0;
+  for (int ty = 0; ty < fb->tiles_h; ty++) {
+    uint8_t *dirty = &ds->dirty[ty * fb->tiles_w];
+    int lo = 0, hi = fb->tiles_w;
+    while (lo < hi && !dirty[lo]) lo++;
+    while (hi > lo && !dirty[hi - 1]) hi--;
+    if (lo == hi) continue;
+    memset(&dirty[lo], 0, hi - lo);
+
+    int x = lo * TEXTURE_W, y = ty * TEXTURE_H;
+    int w = (hi * TEXTURE_W > W ? W : hi * TEXTURE_W) - x;
+    int h = (y + TEXTURE_H > H) ? H - y : TEXTURE_H;
+    _DEV_VIDEO_RECT_t *last = nr > 0 ? &fb->rects[nr - 1] : NULL;
+    if (last && last->x == x && last->w == w && last->y + last->h == y) {
+      last->h += h;
+    } else {
+      fb->rects[nr++] = (_DEV_VIDEO_RECT_t) { .x = x, .y = y, .w = w, .h = h };
+    }
+  }
+  ds->changed = false;
+  return nr;
+}
+
+static void fb_compose(fb_t *fb, int id) {
+  // on the current display the redrawn tiles go out in a single blit
+  struct fb_display *ds = &fb->displays[id];
+  if (!ds->changed) return;
+  int nr = fb_redraw(fb, ds);
+  if (id == fb->info->current && nr > 0) fb_blit(fb, ds, fb->rects, nr);
+}
+
+static void fb_update(fb_t *fb, int slot, const struct sprite *sp, int n) {
+  // stores sprites into slots of their displays, marking what they cover
+  // now and what the slot covered before; unchanged slots cost nothing
+  for (int i = 0; i < n; i++, slot++) {
+    if (sp[i].display >= fb->info->num_displays) continue;
+    struct sprite s = sp[i];
+    if (s.texture >= fb->info->num_textures) s.texture = 0; // no such texture, shows nothing
+    struct fb_display *ds = fb_display(fb, s.display);
+    struct sprite *old = &ds->sprites[slot];
+    if (!memcmp(old, &s, sizeof(struct sprite))) continue;
+    fb_mark(fb, ds, old);
+    fb_mark(fb, ds, &s);
+    *old = s;
+    if (slot >= ds->nr_used && old->texture > 0) ds->nr_used = slot + 1;
+  }
+  for (int id = 0; id < fb->info->num_displays; id++) {
+    fb_compose(fb, id);
+  }
+}
+
+static void fb_retexture(fb_t *fb, int lo, int hi) {
+  // textures lo to hi changed, every slot showing one of them is redrawn
+  for (int id = 0; id < fb->info->num_displays; id++) {
+    struct fb_display *ds = &fb->displays[id];
+    if (!ds->sprites) continue;
+    for (int i = 0; i < ds->nr_used; i++) {
+      const struct sprite *sp = &ds->sprites[i];
+      if (sp->texture >= lo && sp->texture <= hi) fb_mark(fb, ds, sp);
+    }
+    fb_compose(fb, id);
+  }
+}
+
+static bool fb_lift(fb_t *fb, struct fb_display *ds, struct sprite *sp, int dy) {
+  // moves sp up dy pixels along with the back buffer and marks where the
+  // moved pixels are not what sp shows; false once sp is off the top
+  if (sp->texture == 0) return false;
+  if (sp->y < dy) {
+    struct sprite rest = *sp;
+    rest.y = 0;
+    if (sp->y + TEXTURE_H > dy) fb_mark(fb, ds, &rest);
+    return false;
+  }
+  sp->y -= dy;
+  if (sp->y + TEXTURE_H > fb->info->height - dy) fb_mark(fb, ds, sp);
+  return true;
+}
+
+static int fb_scroll(fb_t *fb, const struct fb_scroll *sc) {
+  // the back buffer is moved instead of composed again, only tiles the
+  // move cannot account for are redrawn, then the display goes out whole
+  int W = fb->info->width, H = fb->info->height;
+  if (sc->display < 0 || sc->display >= fb->info->num_displays) return E_BADTP;
+  if (sc->dy <= 0 || sc->dy >= H || sc->slots < 0) return E_BADTP;
+  struct fb_display *ds = fb_display(fb, sc->display);
+
+  for (int y = 0; y < H - sc->dy; y++) {
+    memcpy(&ds->back[y * W], &ds->back[(y + sc->dy) * W], W * sizeof(uint32_t));
+  }
+  memset(&ds->back[(H - sc->dy) * W], 0, sc->dy * W * sizeof(uint32_t));
+
+  int n = ds->nr_used > sc->slots ? ds->nr_used - sc->slots : 0;
+  for (int i = 0; i < ds->nr_used; i++) {
+    struct sprite sp = ds->sprites[i];
+    bool kept = fb_lift(fb, ds, &sp, sc->dy);
+    if (i < sc->slots) {
+      if (kept) fb_mark(fb, ds, &sp); // dropped while still on the screen
+    } else {
+      if (!kept) sp.texture = 0;
+      ds->sprites[i - sc->slots] = sp;
+    }
+  }
+  for (int i = n; i < ds->nr_used; i++) {
+    ds->sprites[i] = (struct sprite) {};
+  }
+  ds->nr_used = n;
+
+  if (ds->changed) fb_redraw(fb, ds);
+  if (sc->display == fb->info->current) {
+    _DEV_VIDEO_RECT_t all = { .x = 0, .y = 0, .w = W, .h = H };
+    fb_blit(fb, ds, &all, 1);
+  }
   return 0;
 }
 
+static void fb_flip(fb_t *fb, int id) {
+  // the back buffer of a display is always up to date
+  fb->info->current = id;
+  struct fb_display *ds = fb_display(fb, id);
+  _DEV_VIDEO_RECT_t all = { .x = 0, .y = 0, .w = fb->info->width, .h = fb->info->height };
+  fb_blit(fb, ds, &all, 1);
+}
+
 ssize_t fb_write(device_t *dev, off_t offset, const void *buf, size_t count) {
+  // sprites are written to their slots: n sprites at SPRITE_BRK + k *
+  // sizeof(struct sprite) fill slots k to k + n - 1
   fb_t *fb = dev->ptr;
   kmt->sem_wait(&fb_sem);
   if (offset == 0) {
     const struct display_info *info = buf;
-    if (fb->info->current != info->current) {
-      fb->info->current = info->current;
+    if (fb->info->current != info->current && info->current < fb->info->num_displays) {
+      fb_flip(fb, info->current);
     }
   } else if (offset < SPRITE_BRK) {
-    memcpy(((uint8_t *)fb->textures) + offset, buf, count);
+    // the texture area is larger than the textures there are
+    size_t size = sizeof(struct texture) * NTEXTURE;
+    if (offset >= size) {
+      count = 0;
+    } else if (count > size - offset) {
+      count = size - offset;
+    }
+    if (count > 0) {
+      memcpy(((uint8_t *)fb->textures) + offset, buf, count);
+      fb_retexture(fb, offset / sizeof(struct texture), (offset + count - 1) / sizeof(struct texture));
+    }
   } else {
-    // TODO: not remove stale sprites, and does not consider z-values
-    _DEV_VIDEO_FBCTL_t ctl = {
-      .w = TEXTURE_W,
-      .h = TEXTURE_H,
-    };
-    for (struct sprite *sp = (struct sprite *)buf; sp < (struct sprite *)(buf + count); sp++) {
-      if (sp->texture > 0 && sp->display == fb->info->current) {
-        ctl.x = sp->x;
-        ctl.y = sp->y;
-        ctl.pixels = fb->textures[sp->texture].pixels;
-        _io_write(_DEV_VIDEO, _DEVREG_VIDEO_FBCTL, &ctl, sizeof(ctl));
-      }
+    int slot = (offset - SPRITE_BRK) / sizeof(struct sprite);
+    int n = count / sizeof(struct sprite);
+    if (slot >= NSPRITE) {
+      n = 0;
+    } else if (n > NSPRITE - slot) {
+      n = NSPRITE - slot;
     }
+    fb_update(fb, slot, buf, n);
+    count = n * sizeof(struct sprite);
   }
   kmt->sem_signal(&fb_sem);
   return count;
 }
 
+int fb_ioctl(device_t *dev, int request, void *arg) {
+  fb_t *fb = dev->ptr;
+  int ret = E_BADTP;
+  kmt->sem_wait(&fb_sem);
+  if (request == FB_SCROLL) ret = fb_scroll(fb, arg);
+  kmt->sem_signal(&fb_sem);
+  return ret;
+}
+
 devops_t fb_ops = {
   .init = fb_init,
   .read = fb_read,
   .write = fb_write,
+  .ioctl = fb_ioctl,
 };
@@ -1,16 +1,54 @@
 #include <common.h>
 #include <file.h>
+#include <dcache.h>
+
+static inline const char *inode_name(inode_t *ip) {
+  const char *name = ip->path;
+  for (const char *p = ip->path; *p; ++p) {
+    if (*p == '/') name = p + 1;
+  }
+  return name;
+}
+
+static inode_t *inode_child(inode_t *parent, const char *name, size_t len) {
+  bool hit = false;
+  inode_t *ret = dcache_lookup(parent, name, len, &hit);
+  if (hit) return ret;
+
+  ret = NULL;
+  for (inode_t *ip = parent->fchild; ip != NULL; ip = ip->cousin) {
+    const char *ip_name = inode_name(ip);
+    if (strlen(ip_name) == len && !strncmp(ip_name, name, len)) {
+      ret = ip;
+      break;
+    }
+  }
+  if (!ret && parent->fs && parent->fs->ops->fetch) {
+    ret = parent->fs->ops->fetch(parent->fs, parent, name, len);
+  }
+  dcache_enter(parent, name, len, ret);
+  return ret;
+}
 
 inode_t *inode_search(inode_t *cur, const char *path) {
   VFSCLog(FG_BLUE, "looking for %s from %s", path, cur->path);
-  for (inode_t *ip = cur->fchild; ip != NULL; ip = ip->cousin) {
+  size_t len = strlen(cur->path);
+  if (strncmp(path, cur->path, len)) return cur;
+  if (len > 0 && cur->path[len - 1] != '/' && path[len] != '/' && path[len] != '\0') return cur;
+
+  const char *p = path + len;
+  while (true) {
+    while (*p == '/') ++p;
+    if (*p == '\0') return cur;
+    const char *q = p;
+    while (*q != '\0' && *q != '/') ++q;
+
+    inode_t *ip = inode_child(cur, p, q - p);
+    if (!ip) return cur;
     VFSCLog(FG_BLUE, "%s -> %s", cur->path, ip->path);
-    if (!strncmp(path, ip->path, strlen(ip->path))) {
-      if (strlen(path) == strlen(ip->path)) return ip;
-      else return inode_search(ip, path);
-    }
+    cur = ip;
+    p = q;
   }
-  return cur;
 }
 
 void inode_insert(inode_t *parent, inode_t *child) {
@@ -21,6 +59,8 @@ void inode_insert(inode_t *parent, inode_t *child) {
   } else {
     parent->fchild = child;
   }
+  const char *name = inode_name(child);
+  dcache_enter(parent, name, strlen(name), child);
 }
 
 void inode_remove(inode_t *parent, inode_t *child) {
@@ -32,6 +72,7 @@ void inode_remove(inode_t *parent, inode_t *child) {
     if (ip->cousin == NULL) return;
     ip->cousin = child->cousin;
   }
+  dcache_purge(child);
 }
 
 void inode_delete(inode_t *cur) {
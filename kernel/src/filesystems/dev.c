@@ -28,27 +28,123 @@ void mount_devfs() {
 
 int devops_open(filesystem_t *fs, file_t *file, int flags) {
   if ((flags & file->inode->flags) != (flags & ~O_CREAT)) return E_BADPR;
-  file->inode->offset = 0;
+  file->offset = 0;
   return 0;
 }
 
 int devops_close(filesystem_t *fs, file_t *file) {
-  file->inode->offset = 0;
+  file->offset = 0;
   return fs->ops->close(file->inode);
 }
 
+static ssize_t dev_read_at(device_t *device, off_t offset, char *buf, size_t size) {
+  // block devices go through the page cache, so a mounted filesystem and
+  // its raw device see the same bytes
+  if (!device->blk) return device->ops->read(device, offset, buf, size);
+  off_t end = device->ops->size(device);
+  if (offset >= end) return 0;
+  if (size > end - offset) size = end - offset;
+  return pcache_read(device, offset, buf, size);
+}
+
+static ssize_t dev_write_at(device_t *device, off_t offset, const char *buf, size_t size) {
+  if (!device->blk) return device->ops->write(device, offset, buf, size);
+  off_t end = device->ops->size(device);
+  if (offset >= end) return 0;
+  if (size > end - offset) size = end - offset;
+  return pcache_write(device, offset, buf, size);
+}
+
 ssize_t devops_read(filesystem_t *fs, file_t *file, char *buf, size_t size) {
   device_t *device = (device_t *)file->inode->ptr;
-  return device->ops->read(device, 0, buf, size);
+  ssize_t nread = dev_read_at(device, file->offset, buf, size);
+  if (nread > 0) file->offset += nread;
+  return nread;
 }
 
 ssize_t devops_write(filesystem_t *fs, file_t *file, const char *buf, size_t size) {
   device_t *device = (device_t *)file->inode->ptr;
-  return device->ops->write(device, 0, buf, size);
+  ssize_t nwrite = dev_write_at(device, file->offset, buf, size);
+  if (nwrite > 0) file->offset += nwrite;
+  return nwrite;
+}
+
+ssize_t devops_pread(filesystem_t *fs, file_t *file, char *buf, size_t size, off_t offset) {
+  device_t *device = (device_t *)file->inode->ptr;
+  return dev_read_at(device, offset, buf, size);
+}
+
+ssize_t devops_pwrite(filesystem_t *fs, file_t *file, const char *buf, size_t size, off_t offset) {
+  device_t *device = (device_t *)file->inode->ptr;
+  return dev_write_at(device, offset, buf, size);
+}
+
+ssize_t devops_readv(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt) {
+  device_t *device = (device_t *)file->inode->ptr;
+  ssize_t nread = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    ssize_t delta = dev_read_at(device, file->offset + nread, iov[i].iov_base, iov[i].iov_len);
+    if (delta < 0) {
+      if (!nread) return delta;
+      break;
+    }
+    nread += delta;
+    if (delta < iov[i].iov_len) break;
+  }
+  file->offset += nread;
+  return nread;
+}
+
+ssize_t devops_writev(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt) {
+  device_t *device = (device_t *)file->inode->ptr;
+  ssize_t nwrite = 0;
+  if (device->ops->writev && !device->blk) {
+    nwrite = device->ops->writev(device, file->offset, iov, iovcnt);
+    if (nwrite > 0) file->offset += nwrite;
+    return nwrite;
+  }
+  for (int i = 0; i < iovcnt; ++i) {
+    ssize_t delta = dev_write_at(device, file->offset + nwrite, iov[i].iov_base, iov[i].iov_len);
+    if (delta < 0) {
+      if (!nwrite) return delta;
+      break;
+    }
+    nwrite += delta;
+    if (delta < iov[i].iov_len) break;
+  }
+  file->offset += nwrite;
+  return nwrite;
+}
+
+off_t devops_lseek(filesystem_t *fs, file_t *file, off_t offset, int whence) {
+  // stream devices ignore the offset, SEEK_END needs a sized device
+  device_t *device = (device_t *)file->inode->ptr;
+  switch (whence) {
+    case SEEK_SET:
+      file->offset = offset;
+      break;
+    case SEEK_CUR:
+      file->offset += offset;
+      break;
+    case SEEK_END:
+      if (!device->ops->size) return E_BADTP;
+      file->offset = device->ops->size(device) + offset;
+      break;
+    default:
+      return E_BADTP;
+  }
+  return file->offset;
+}
+
+int devops_ioctl(filesystem_t *fs, file_t *file, int request, void *arg) {
+  device_t *device = (device_t *)file->inode->ptr;
+  if (!device->ops->ioctl) return E_BADTP;
+  return device->ops->ioctl(device, request, arg);
 }
 
 void devfs_init(filesystem_t *fs, const char *path, device_t *dev) {
   if (!fs->root) {
+    spinlock_init(&fs->lock, fs->name);
     fs->root = pmm->alloc(sizeof(inode_t));
     fs->root->type = TYPE_MNTP;
     fs->root->flags = P_RD;
@@ -64,6 +160,12 @@ void devfs_init(filesystem_t *fs, const char *path, device_t *dev) {
     fs->root->ops->close = devops_close;
     fs->root->ops->read = devops_read;
     fs->root->ops->write = devops_write;
+    fs->root->ops->pread = devops_pread;
+    fs->root->ops->pwrite = devops_pwrite;
+    fs->root->ops->readv = devops_readv;
+    fs->root->ops->writev = devops_writev;
+    fs->root->ops->lseek = devops_lseek;
+    fs->root->ops->ioctl = devops_ioctl;
   }
 
   for (int i = 0; i < nr_devices; ++i) {
@@ -80,6 +182,12 @@ void devfs_init(filesystem_t *fs, const char *path, device_t *dev) {
     ip->ops->close = devops_close;
     ip->ops->read = devops_read;
     ip->ops->write = devops_write;
+    ip->ops->pread = devops_pread;
+    ip->ops->pwrite = devops_pwrite;
+    ip->ops->readv = devops_readv;
+    ip->ops->writev = devops_writev;
+    ip->ops->lseek = devops_lseek;
+    ip->ops->ioctl = devops_ioctl;
 
     ip->parent = fs->root;
     ip->fchild = NULL;
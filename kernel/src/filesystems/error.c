@@ -18,10 +18,34 @@ ssize_t error_write(filesystem_t *fs, file_t *file, const char *buf, size_t size
   return E_BADFS;
 }
 
+ssize_t error_pread(filesystem_t *fs, file_t *file, char *buf, size_t size, off_t offset) {
+  return E_BADFS;
+}
+
+ssize_t error_pwrite(filesystem_t *fs, file_t *file, const char *buf, size_t size, off_t offset) {
+  return E_BADFS;
+}
+
+ssize_t error_readv(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt) {
+  return E_BADFS;
+}
+
+ssize_t error_writev(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt) {
+  return E_BADFS;
+}
+
 off_t error_lseek(filesystem_t *fs, file_t *file, off_t offset, int whence) {
   return E_BADFS;
 }
 
+ssize_t error_get_page(filesystem_t *fs, file_t *file, off_t offset, const void **page) {
+  return E_BADFS;
+}
+
+int error_ioctl(filesystem_t *fs, file_t *file, int request, void *arg) {
+  return E_BADFS;
+}
+
 int error_mkdir(filesystem_t *fs, const char *path) {
   return E_BADFS;
 }
@@ -47,7 +71,13 @@ inodeops_t error_ops = {
   .close   = error_close,
   .read    = error_read,
   .write   = error_write,
+  .pread   = error_pread,
+  .pwrite  = error_pwrite,
+  .readv   = error_readv,
+  .writev  = error_writev,
   .lseek   = error_lseek,
+  .get_page = error_get_page,
+  .ioctl   = error_ioctl,
   .mkdir   = error_mkdir,
   .rmdir   = error_rmdir,
   .link    = error_link,
@@ -2,14 +2,173 @@
 #include <file.h>
 #include <vfs.h>
 
+// On-disk layout (version 6):
+//   [superblock | inode table | free-block bitmap | journal | data blocks ...]
+// Every inode maps its data with a sorted array of extents, kept inline
+// while it is small and spilled to a run of data blocks otherwise.
+// Directories keep their entries as data, inode 0 is the root directory.
+// Metadata updates of one operation form a transaction that is logged to
+// the journal in a single write before any of it may reach its home.
+
+#define NAIVEFS_MAGIC      0x5646414e // "NAFV"
+#define NAIVEFS_VERSION    6
+#define NAIVEFS_SUPER_SIZE 256
+#define NAIVEFS_BLK_SIZE   1024 // default, chosen at format time
+#define NAIVEFS_MIN_BLK    512
+#define NAIVEFS_MAX_BLK    (64 << 10)
+#define NAIVEFS_NAME_LEN   255
+#define NAIVEFS_BENCH_CHUNK 4096
+#define NR_INLINE_EXTENTS  8 // 4 before version 4, which dropped the path
+#define NAIVEFS_DINODE_SIZE 128
+#define NR_NAIVEFS_ICACHE  256 // in-memory inodes before unused ones get evicted
+#define NR_ICACHE_BUCKETS  64
+#define NR_LINK_HOPS       8
+#define NAIVEFS_JNL_MAGIC  0x4c4e4a4e // "NJNL"
+#define NAIVEFS_TXN_MAGIC  0x4e58544e // "NTXN"
+#define NAIVEFS_JNL_MIN    (4 << 10)  // never shares a page with both neighbours
+#define NAIVEFS_JNL_MAX    (256 << 10)
+#define NR_JOURNAL_PINS    32
+
 typedef struct naivefs_params {
+  uint32_t magic;
+  uint32_t version;
+  int32_t blk_size;
+  int32_t nr_blks;
+  int32_t itable;    // first block of the inode table
+  int32_t nr_inodes;
+  int32_t ino_top;   // inodes at or above this were never used
+  int32_t free_ino;  // head of the freed inode list, 0 when empty
+  int32_t bitmap;    // first block of the free-block bitmap
+  int32_t data_head; // first data block
+  int32_t nr_free;
+  int32_t goal;      // where the next search for a free block starts
+  int32_t journal;   // first block of the journal
+  int32_t journal_blks;
+} naivefs_params_t;
+
+// The journal starts with a naivefs_jsuper_t, followed by committed
+// transactions: a naivefs_txn_t, then records of (offset, len) and len
+// bytes rounded up to 4. Replay stops at the first header whose magic,
+// sequence number or checksum does not match.
+typedef struct naivefs_jsuper {
+  uint32_t magic;
+  uint32_t seq; // of the first transaction after this header
+} naivefs_jsuper_t;
+
+typedef struct naivefs_txn {
+  uint32_t magic;
+  uint32_t seq;
+  uint32_t size;     // header included
+  uint32_t nr_records;
+  uint32_t checksum; // of everything after the header
+} naivefs_txn_t;
+
+typedef struct naivefs_record {
+  uint32_t offset, len;
+  char *data;
+} naivefs_record_t;
+
+typedef struct naivefs_journal {
+  struct spinlock lock; // held for a whole transaction, after fs->lock
+  int depth;            // nested begins on the holding cpu
+  uint32_t seq;
+  uint32_t head;        // where the next transaction goes
+  uint32_t size;
+  int nr, cap;
+  naivefs_record_t *recs;
+  uint32_t used;        // log bytes the records take
+  bool revoke;          // metadata blocks were freed, their records must not replay
+  int nr_pins;
+  struct page *pins[NR_JOURNAL_PINS];
+} naivefs_journal_t;
+
+// Every loaded inode but the root sits in the inode cache, which is
+// protected by fs->lock like the rest of the tree.
+typedef struct naivefs_icache {
+  int32_t ino;
+  int pins; // loaded links pointing at this inode
+  inode_t *inode;
+  struct naivefs_icache *hnext;
+  struct naivefs_icache *prev, *next; // LRU, most recent first
+} naivefs_icache_t;
+
+typedef struct naivefs_info {
+  naivefs_params_t params; // in-memory copy of the superblock
+  uint32_t *bitmap;        // bit set = block in use
+  struct spinlock lock;    // protects the bitmap, taken after inode locks
+  naivefs_icache_t *icache[NR_ICACHE_BUCKETS];
+  naivefs_icache_t lru;
+  int nr_cached;
+  naivefs_journal_t journal;
+} naivefs_info_t;
+
+typedef struct naivefs_extent {
+  int32_t lblk, pblk, len;
+} naivefs_extent_t;
+
+typedef struct naivefs_dinode {
+  int16_t type;
+  int16_t flags;
+  int32_t size;
+  int32_t link;       // target inode of a link, next free inode once freed
+  int32_t nr_extents;
+  int32_t ext_blk;    // extents live here once they outgrow the inline slots
+  int32_t ext_cap;
+  int32_t parent;     // directory holding the entry
+  int32_t reserved;
+  naivefs_extent_t extents[NR_INLINE_EXTENTS];
+} naivefs_dinode_t;
+_Static_assert(sizeof(naivefs_dinode_t) == NAIVEFS_DINODE_SIZE, "dinode layout changed");
+
+// Directory entries never cross a block, the last one in a block
+// stretches to its end and freed ones are merged into their predecessor.
+typedef struct naivefs_dirent {
+  int32_t ino;      // 0 for a free record at the start of a block
+  uint32_t hash;    // of the name, compared before the name itself
+  uint32_t rec_len; // distance to the next record
+  uint16_t name_len;
+  uint16_t type;
+  char name[];
+} naivefs_dirent_t;
+
+#define NAIVEFS_DIRENT_SIZE(len) ((sizeof(naivefs_dirent_t) + (len) + 3) & ~3)
+
+// In-memory index of a directory, built from its blocks on first use
+// and kept in step by dir_add and dir_remove under the directory lock.
+typedef struct naivefs_dslot {
+  uint32_t hash;
+  int32_t ino;
+  off_t off; // of the record within the directory
+  struct naivefs_dslot *hnext, *inext;
+} naivefs_dslot_t;
+
+typedef struct naivefs_dindex {
+  int nr, nr_buckets;
+  naivefs_dslot_t **by_hash, **by_ino;
+  int32_t nr_blks, cap_blks;
+  uint32_t *room; // largest gap of each block
+} naivefs_dindex_t;
+
+#define NR_DINDEX_BUCKETS 16 // to start with, doubled as entries come in
+
+typedef struct naivefs_emap {
+  int nr, cap;
+  naivefs_extent_t *ext;
+  int32_t disk_blk, disk_cap;
+  naivefs_dindex_t *index; // directories only
+} naivefs_emap_t;
+
+// Legacy (version 0) layout, only read to migrate old images:
+// a flat chain of 32-byte entries linked through the map table,
+// with file data chained the same way.
+typedef struct naivefs_params_v0 {
   int32_t blk_size;
   int32_t map_head;
   int32_t data_head;
   int32_t min_free;
-} naivefs_params_t;
+} naivefs_params_v0_t;
 
-typedef union naivefs_entry {
+typedef union naivefs_entry_v0 {
   char content[32];
   struct {
     int32_t head;
@@ -17,81 +176,726 @@ typedef union naivefs_entry {
     int16_t flags;
     char path[24];
   };
-} naivefs_entry_t;
+} naivefs_entry_v0_t;
 
-int32_t naivefs_get_next_blk(filesystem_t *fs, int32_t blk) {
-  int32_t ret = 0;
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  off_t offset = params->map_head + blk * sizeof(int32_t);
-  fs->dev->ops->read(fs->dev, offset, (void *)(&ret), sizeof(int32_t));
-  return ret;
+static inline naivefs_params_t *naivefs_params(filesystem_t *fs) {
+  return &((naivefs_info_t *)fs->ptr)->params;
+}
+
+static inline off_t naivefs_blk_offset(filesystem_t *fs, int32_t blk) {
+  return (off_t)blk * naivefs_params(fs)->blk_size;
+}
+
+// Journal
+// -------------------------------------------------------------------
+
+static inline naivefs_journal_t *naivefs_journal(filesystem_t *fs) {
+  return &((naivefs_info_t *)fs->ptr)->journal;
+}
+
+static inline uint32_t naivefs_checksum(const char *buf, size_t len) {
+  uint32_t sum = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    sum ^= (uint8_t)buf[i];
+    sum *= 16777619u;
+  }
+  return sum;
+}
+
+static void naivefs_journal_reset(filesystem_t *fs, uint32_t seq) {
+  // the log bypasses the page cache, it is only ever read back by replay
+  // the first transaction slot is cleared so nothing stale follows the header
+  naivefs_journal_t *j = naivefs_journal(fs);
+  struct {
+    naivefs_jsuper_t jsb;
+    naivefs_txn_t txn;
+  } head = { { NAIVEFS_JNL_MAGIC, seq }, {} };
+  fs->dev->ops->write(fs->dev, naivefs_blk_offset(fs, naivefs_params(fs)->journal), &head, sizeof(head));
+  j->seq = seq;
+  j->head = sizeof(naivefs_jsuper_t);
+}
+
+static void naivefs_checkpoint(filesystem_t *fs) {
+  // caller holds the journal outside of any transaction, once every
+  // logged update is home the log starts over
+  pcache_sync(fs->dev);
+  naivefs_journal_reset(fs, naivefs_journal(fs)->seq);
+}
+
+static void naivefs_log(naivefs_journal_t *j, uint32_t offset, const void *buf, uint32_t len) {
+  // a rewrite of a range that is already logged lands in the same record,
+  // unless some later record overlaps it
+  for (int i = j->nr - 1; i >= 0; --i) {
+    naivefs_record_t *r = &j->recs[i];
+    if (offset >= r->offset && offset + len <= r->offset + r->len) {
+      memcpy(r->data + (offset - r->offset), buf, len);
+      return;
+    }
+    if (offset < r->offset + r->len && r->offset < offset + len) break;
+  }
+  if (j->nr == j->cap) {
+    j->cap = j->cap ? j->cap * 2 : 16;
+    naivefs_record_t *recs = pmm->alloc(j->cap * sizeof(naivefs_record_t));
+    for (int i = 0; i < j->nr; ++i) recs[i] = j->recs[i];
+    if (j->recs) pmm->free(j->recs);
+    j->recs = recs;
+  }
+  naivefs_record_t *r = &j->recs[j->nr++];
+  r->offset = offset;
+  r->len = len;
+  j->used += 2 * sizeof(uint32_t) + ((len + 3) & ~3);
+  r->data = pmm->alloc(len);
+  memcpy(r->data, buf, len);
+}
+
+static void naivefs_commit(filesystem_t *fs) {
+  // the whole transaction goes out in one sequential write
+  naivefs_journal_t *j = naivefs_journal(fs);
+  size_t size = sizeof(naivefs_txn_t) + j->used;
+
+  if (j->nr > 0) {
+    Assert(size <= j->size - j->head, "naivefs: transaction overflows the log");
+    char *buf = pmm->alloc(size);
+    char *p = buf + sizeof(naivefs_txn_t);
+    for (int i = 0; i < j->nr; ++i) {
+      ((uint32_t *)p)[0] = j->recs[i].offset;
+      ((uint32_t *)p)[1] = j->recs[i].len;
+      memcpy(p + 2 * sizeof(uint32_t), j->recs[i].data, j->recs[i].len);
+      p += 2 * sizeof(uint32_t) + ((j->recs[i].len + 3) & ~3);
+    }
+    naivefs_txn_t *txn = (naivefs_txn_t *)buf;
+    txn->magic = NAIVEFS_TXN_MAGIC;
+    txn->seq = j->seq;
+    txn->size = size;
+    txn->nr_records = j->nr;
+    txn->checksum = naivefs_checksum(buf + sizeof(naivefs_txn_t), size - sizeof(naivefs_txn_t));
+    fs->dev->ops->write(fs->dev, naivefs_blk_offset(fs, naivefs_params(fs)->journal) + j->head, buf, size);
+    pmm->free(buf);
+    j->head += size;
+    ++j->seq;
+  }
+
+  for (int i = 0; i < j->nr; ++i) pmm->free(j->recs[i].data);
+  j->nr = 0;
+  j->used = 0;
+  for (int i = 0; i < j->nr_pins; ++i) pcache_put(j->pins[i]);
+  j->nr_pins = 0;
+  if (j->revoke) {
+    naivefs_checkpoint(fs);
+    j->revoke = false;
+  }
+}
+
+static void naivefs_split(filesystem_t *fs) {
+  // caller holds the journal inside a transaction that outgrew the log,
+  // what is logged so far commits on its own and the log starts over
+  naivefs_journal_t *j = naivefs_journal(fs);
+  naivefs_commit(fs);
+  if (j->head > sizeof(naivefs_jsuper_t)) naivefs_checkpoint(fs);
+}
+
+static void naivefs_meta_write(filesystem_t *fs, off_t offset, const void *buf, size_t len) {
+  // inside a transaction the update is logged too, and its pages stay
+  // pinned so eviction cannot write them home before the commit;
+  // it goes in pieces no bigger than a page or an empty log
+  naivefs_journal_t *j = naivefs_journal(fs);
+  if (!spinlock_holding(&j->lock)) {
+    pcache_write(fs->dev, offset, buf, len);
+    return;
+  }
+  const size_t rec_hdr = 2 * sizeof(uint32_t);
+  size_t max = (j->size - sizeof(naivefs_jsuper_t) - sizeof(naivefs_txn_t) - rec_hdr) & ~3;
+  while (len > 0) {
+    off_t pg = offset - offset % PCACHE_PAGE_SIZE;
+    size_t n = pg + PCACHE_PAGE_SIZE - offset;
+    if (n > max) n = max;
+    if (n > len) n = len;
+
+    bool pinned = false;
+    for (int i = 0; i < j->nr_pins; ++i) {
+      if (j->pins[i]->dev == fs->dev && j->pins[i]->offset == pg) pinned = true;
+    }
+    if (!pinned && j->nr_pins == NR_JOURNAL_PINS) {
+      naivefs_commit(fs); // out of pins, what is logged so far commits and frees them
+    }
+    if (j->head + sizeof(naivefs_txn_t) + j->used + rec_hdr + ((n + 3) & ~3) > j->size) {
+      naivefs_split(fs);
+      pinned = false;
+    }
+    if (!pinned) j->pins[j->nr_pins++] = pcache_get(fs->dev, pg);
+    pcache_write(fs->dev, offset, buf, n);
+    naivefs_log(j, offset, buf, n);
+    offset += n;
+    buf = (const char *)buf + n;
+    len -= n;
+  }
 }
 
-int32_t naivefs_get_last_entry_blk(filesystem_t *fs) {
-  int32_t blk = 1;
-  while (true) {
-    int32_t next = naivefs_get_next_blk(fs, blk);
-    if (next == 0) return blk;
-    else blk = next;
+static inline void naivefs_revoke(filesystem_t *fs) {
+  // freed directory or extent blocks may come back as file data, which
+  // an older record must never overwrite, so the log is emptied at commit
+  naivefs_journal(fs)->revoke = true;
+}
+
+static void naivefs_begin(filesystem_t *fs) {
+  // caller holds no inode lock unless the transaction is already open
+  naivefs_journal_t *j = naivefs_journal(fs);
+  if (spinlock_holding(&j->lock)) {
+    ++j->depth;
+    return;
   }
+  spinlock_acquire(&j->lock);
+  j->depth = 1;
+  if (j->head > j->size / 2) naivefs_checkpoint(fs);
+}
+
+static void naivefs_end(filesystem_t *fs) {
+  naivefs_journal_t *j = naivefs_journal(fs);
+  if (--j->depth > 0) return;
+  naivefs_commit(fs);
+  spinlock_release(&j->lock);
+}
+
+void naivefs_sync(filesystem_t *fs) {
+  naivefs_journal_t *j = naivefs_journal(fs);
+  spinlock_acquire(&j->lock);
+  naivefs_checkpoint(fs);
+  spinlock_release(&j->lock);
+}
+
+static bool naivefs_replay(filesystem_t *fs) {
+  // reapplies every committed transaction, returns whether there was any
+  naivefs_params_t *params = naivefs_params(fs);
+  device_t *dev = fs->dev;
+  off_t base = naivefs_blk_offset(fs, params->journal);
+  uint32_t size = params->journal_blks * params->blk_size;
+  naivefs_jsuper_t jsb;
+  dev->ops->read(dev, base, &jsb, sizeof(jsb));
+  if (jsb.magic != NAIVEFS_JNL_MAGIC) jsb.seq = 1;
+
+  naivefs_journal_t *j = naivefs_journal(fs);
+  j->size = size;
+  uint32_t seq = jsb.seq, head = sizeof(jsb);
+  while (head + sizeof(naivefs_txn_t) <= size) {
+    naivefs_txn_t txn;
+    dev->ops->read(dev, base + head, &txn, sizeof(txn));
+    if (txn.magic != NAIVEFS_TXN_MAGIC || txn.seq != seq) break;
+    if (txn.size < sizeof(txn) || txn.size > size - head) break;
+    char *buf = pmm->alloc(txn.size);
+    dev->ops->read(dev, base + head, buf, txn.size);
+    if (naivefs_checksum(buf + sizeof(txn), txn.size - sizeof(txn)) != txn.checksum) {
+      pmm->free(buf);
+      break;
+    }
+    char *p = buf + sizeof(txn);
+    for (uint32_t i = 0; i < txn.nr_records; ++i) {
+      uint32_t offset = ((uint32_t *)p)[0], len = ((uint32_t *)p)[1];
+      pcache_write(dev, offset, p + 2 * sizeof(uint32_t), len);
+      p += 2 * sizeof(uint32_t) + ((len + 3) & ~3);
+    }
+    pmm->free(buf);
+    head += txn.size;
+    ++seq;
+  }
+
+  if (seq != jsb.seq) pcache_sync(dev);
+  naivefs_journal_reset(fs, seq);
+  return seq != jsb.seq;
 }
 
 void naivefs_put_params(filesystem_t *fs, naivefs_params_t *params) {
-  fs->dev->ops->write(fs->dev, 0, (void *)params, sizeof(naivefs_params_t));
+  naivefs_meta_write(fs, 0, (void *)params, sizeof(naivefs_params_t));
 }
 
-void naivefs_add_map(filesystem_t *fs, int32_t from, int32_t to) {
-  if (from == to) to = 0; // for reformatted disks (like 1 -> 1)
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  fs->dev->ops->write(fs->dev, params->map_head + from * sizeof(int32_t), (void *)(&to), sizeof(int32_t));
+void naivefs_get_dinode(filesystem_t *fs, int32_t ino, naivefs_dinode_t *d) {
+  naivefs_params_t *params = naivefs_params(fs);
+  off_t offset = naivefs_blk_offset(fs, params->itable) + ino * sizeof(naivefs_dinode_t);
+  pcache_read(fs->dev, offset, (void *)d, sizeof(naivefs_dinode_t));
 }
 
-naivefs_entry_t naivefs_get_entry(filesystem_t *fs, int32_t blk) {
-  naivefs_entry_t ret;
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  off_t offset = params->data_head + blk * params->blk_size;
-  fs->dev->ops->read(fs->dev, offset, (void *)(&ret), sizeof(naivefs_entry_t));
-  return ret;
+void naivefs_put_dinode(filesystem_t *fs, int32_t ino, naivefs_dinode_t *d) {
+  naivefs_params_t *params = naivefs_params(fs);
+  off_t offset = naivefs_blk_offset(fs, params->itable) + ino * sizeof(naivefs_dinode_t);
+  naivefs_meta_write(fs, offset, (void *)d, sizeof(naivefs_dinode_t));
+}
+
+int32_t naivefs_alloc_ino(filesystem_t *fs) {
+  // caller holds fs->lock, reuses freed inodes before growing ino_top
+  naivefs_params_t *params = naivefs_params(fs);
+  int32_t ino = -1;
+  if (params->free_ino) {
+    naivefs_dinode_t d;
+    ino = params->free_ino;
+    naivefs_get_dinode(fs, ino, &d);
+    params->free_ino = d.link;
+  } else if (params->ino_top < params->nr_inodes) {
+    ino = params->ino_top++;
+  }
+  if (ino > 0) naivefs_put_params(fs, params);
+  return ino;
+}
+
+void naivefs_free_ino(filesystem_t *fs, int32_t ino) {
+  // caller holds fs->lock
+  naivefs_params_t *params = naivefs_params(fs);
+  naivefs_dinode_t d = {};
+  d.type = TYPE_INVL;
+  d.link = params->free_ino;
+  naivefs_put_dinode(fs, ino, &d);
+  params->free_ino = ino;
+  naivefs_put_params(fs, params);
+}
+
+static void naivefs_zero_blks(filesystem_t *fs, int32_t blk, int32_t n) {
+  static const char zeros[512] = {};
+  off_t offset = naivefs_blk_offset(fs, blk);
+  size_t left = (size_t)n * naivefs_params(fs)->blk_size;
+  while (left > 0) {
+    size_t len = left < sizeof(zeros) ? left : sizeof(zeros);
+    pcache_write(fs->dev, offset, zeros, len);
+    offset += len;
+    left -= len;
+  }
 }
 
-void naivefs_put_entry(filesystem_t *fs, int32_t blk, naivefs_entry_t *entry) {
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  off_t offset = params->data_head + blk * params->blk_size;
-  fs->dev->ops->write(fs->dev, offset, (void *)entry, sizeof(naivefs_entry_t));
+// Free-block bitmap
+// -------------------------------------------------------------------
+
+static void naivefs_mark_blks(filesystem_t *fs, int32_t blk, int32_t n, bool used) {
+  // caller holds info->lock, each touched word is written through
+  naivefs_info_t *info = fs->ptr;
+  naivefs_params_t *params = &info->params;
+  off_t base = naivefs_blk_offset(fs, params->bitmap);
+  for (int32_t b = blk; b < blk + n; ) {
+    int32_t w = b / 32;
+    for ( ; b < blk + n && b / 32 == w; ++b) {
+      if (used) info->bitmap[w] |= 1u << (b % 32);
+      else      info->bitmap[w] &= ~(1u << (b % 32));
+    }
+    naivefs_meta_write(fs, base + w * sizeof(uint32_t), &info->bitmap[w], sizeof(uint32_t));
+  }
+  params->nr_free += used ? -n : n;
+}
+
+static int32_t naivefs_find_free(naivefs_info_t *info, int32_t goal, int32_t n) {
+  // first run of n free blocks at or after goal, wrapping around once
+  naivefs_params_t *params = &info->params;
+  if (goal < params->data_head || goal >= params->nr_blks) goal = params->data_head;
+
+  int32_t from = goal, to = params->nr_blks;
+  for (int pass = 0; pass < 2; ++pass) {
+    int32_t run = 0;
+    for (int32_t b = from; b < to; ) {
+      uint32_t word = info->bitmap[b / 32];
+      if (run == 0) {
+        // word at a time until some block at or after b is free
+        uint32_t free = ~word & (~0u << (b % 32));
+        if (!free) {
+          b = (b / 32 + 1) * 32;
+          continue;
+        }
+        b = b / 32 * 32 + __builtin_ctz(free);
+        if (b >= to) break;
+      }
+      if (word & (1u << (b % 32))) {
+        run = 0;
+      } else if (++run == n) {
+        return b - n + 1;
+      }
+      ++b;
+    }
+    from = params->data_head;
+    to = goal;
+  }
+  return -1;
 }
 
-int32_t naivefs_add_entry(filesystem_t *fs, naivefs_entry_t *entry) {
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  int32_t last = naivefs_get_last_entry_blk(fs);
-  int32_t blk = params->min_free;
-  ++params->min_free;
-  naivefs_add_map(fs, last, blk);
-  naivefs_put_entry(fs, blk, entry);
+int32_t naivefs_alloc_blks(filesystem_t *fs, int32_t goal, int32_t n) {
+  // returns the first of n contiguous blocks near goal, or 0 when full
+  naivefs_info_t *info = fs->ptr;
+  naivefs_params_t *params = &info->params;
+  spinlock_acquire(&info->lock);
+  int32_t blk = params->nr_free >= n ? naivefs_find_free(info, goal ? goal : params->goal, n) : -1;
+  if (blk < 0) {
+    spinlock_release(&info->lock);
+    return 0;
+  }
+  naivefs_mark_blks(fs, blk, n, true);
+  params->goal = blk + n;
   naivefs_put_params(fs, params);
+  spinlock_release(&info->lock);
   return blk;
 }
 
-size_t naivefs_get_file_size(filesystem_t *fs, naivefs_entry_t *entry) {
-  size_t ret = 0;
-  int32_t blk = entry->head;
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  while (true) {
-    int32_t next = naivefs_get_next_blk(fs, blk);
-    if (next) {
-      ret += params->blk_size;
+void naivefs_free_blks(filesystem_t *fs, int32_t blk, int32_t n) {
+  naivefs_info_t *info = fs->ptr;
+  spinlock_acquire(&info->lock);
+  naivefs_mark_blks(fs, blk, n, false);
+  naivefs_put_params(fs, &info->params);
+  spinlock_release(&info->lock);
+}
+
+// Directory index
+// -------------------------------------------------------------------
+
+static void naivefs_dindex_link(naivefs_dindex_t *idx, naivefs_dslot_t *s) {
+  uint32_t mask = idx->nr_buckets - 1;
+  s->hnext = idx->by_hash[s->hash & mask];
+  idx->by_hash[s->hash & mask] = s;
+  s->inext = idx->by_ino[(uint32_t)s->ino & mask];
+  idx->by_ino[(uint32_t)s->ino & mask] = s;
+}
+
+static void naivefs_dindex_resize(naivefs_dindex_t *idx, int nr_buckets) {
+  naivefs_dslot_t *all = NULL;
+  for (int b = 0; b < idx->nr_buckets; ++b) {
+    while (idx->by_hash[b]) {
+      naivefs_dslot_t *s = idx->by_hash[b];
+      idx->by_hash[b] = s->hnext;
+      s->hnext = all;
+      all = s;
+    }
+  }
+  if (idx->by_hash) {
+    pmm->free(idx->by_hash);
+    pmm->free(idx->by_ino);
+  }
+  idx->nr_buckets = nr_buckets;
+  idx->by_hash = pmm->alloc(nr_buckets * sizeof(naivefs_dslot_t *));
+  idx->by_ino = pmm->alloc(nr_buckets * sizeof(naivefs_dslot_t *));
+  while (all) {
+    naivefs_dslot_t *s = all;
+    all = s->hnext;
+    naivefs_dindex_link(idx, s);
+  }
+}
+
+static void naivefs_dindex_add(naivefs_dindex_t *idx, uint32_t hash, int32_t ino, off_t off) {
+  if (idx->nr >= 2 * idx->nr_buckets) naivefs_dindex_resize(idx, 2 * idx->nr_buckets);
+  naivefs_dslot_t *s = pmm->alloc(sizeof(naivefs_dslot_t));
+  s->hash = hash;
+  s->ino = ino;
+  s->off = off;
+  naivefs_dindex_link(idx, s);
+  ++idx->nr;
+}
+
+static void naivefs_dindex_del(naivefs_dindex_t *idx, naivefs_dslot_t *s) {
+  uint32_t mask = idx->nr_buckets - 1;
+  naivefs_dslot_t **pp = &idx->by_hash[s->hash & mask];
+  while (*pp != s) pp = &(*pp)->hnext;
+  *pp = s->hnext;
+  pp = &idx->by_ino[(uint32_t)s->ino & mask];
+  while (*pp != s) pp = &(*pp)->inext;
+  *pp = s->inext;
+  pmm->free(s);
+  --idx->nr;
+}
+
+static naivefs_dslot_t *naivefs_dindex_find(naivefs_dindex_t *idx, int32_t ino) {
+  naivefs_dslot_t *s = idx->by_ino[(uint32_t)ino & (idx->nr_buckets - 1)];
+  while (s && s->ino != ino) s = s->inext;
+  return s;
+}
+
+static void naivefs_dindex_set_room(naivefs_dindex_t *idx, int32_t blk, uint32_t room) {
+  if (blk >= idx->cap_blks) {
+    int32_t cap = idx->cap_blks ? idx->cap_blks : 8;
+    while (cap <= blk) cap *= 2;
+    uint32_t *r = pmm->alloc(cap * sizeof(uint32_t));
+    for (int32_t i = 0; i < idx->nr_blks; ++i) r[i] = idx->room[i];
+    if (idx->room) pmm->free(idx->room);
+    idx->room = r;
+    idx->cap_blks = cap;
+  }
+  if (blk >= idx->nr_blks) idx->nr_blks = blk + 1;
+  idx->room[blk] = room;
+}
+
+static void naivefs_dindex_free(naivefs_dindex_t *idx) {
+  for (int b = 0; b < idx->nr_buckets; ++b) {
+    while (idx->by_hash[b]) {
+      naivefs_dslot_t *s = idx->by_hash[b];
+      idx->by_hash[b] = s->hnext;
+      pmm->free(s);
+    }
+  }
+  pmm->free(idx->by_hash);
+  pmm->free(idx->by_ino);
+  if (idx->room) pmm->free(idx->room);
+  pmm->free(idx);
+}
+
+// Extent map
+// -------------------------------------------------------------------
+
+static int naivefs_emap_find(naivefs_emap_t *map, int32_t lblk) {
+  // index of the last extent starting at or before lblk, or -1;
+  // the tail extent is checked first so appends skip the search
+  if (map->nr > 0 && map->ext[map->nr - 1].lblk <= lblk) return map->nr - 1;
+  int lo = 0, hi = map->nr - 1, ret = -1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (map->ext[mid].lblk <= lblk) {
+      ret = mid;
+      lo = mid + 1;
     } else {
-      naivefs_entry_t ce = naivefs_get_entry(fs, blk);
-      for (size_t i = 0; i < params->blk_size; ++i) {
-        if (!ce.content[i]) break;
-        ++ret;
-      }
-      break;
+      hi = mid - 1;
     }
-    blk = next;
   }
   return ret;
 }
 
+int32_t naivefs_bmap(naivefs_emap_t *map, int32_t lblk, int32_t *run) {
+  // physical block of lblk (0 for a hole) and how many follow contiguously
+  int i = naivefs_emap_find(map, lblk);
+  if (i < 0 || lblk >= map->ext[i].lblk + map->ext[i].len) return 0;
+  if (run) *run = map->ext[i].len - (lblk - map->ext[i].lblk);
+  return map->ext[i].pblk + (lblk - map->ext[i].lblk);
+}
+
+void naivefs_emap_insert(naivefs_emap_t *map, int32_t lblk, int32_t pblk) {
+  int i = naivefs_emap_find(map, lblk);
+  naivefs_extent_t *prev = i >= 0 ? &map->ext[i] : NULL;
+  naivefs_extent_t *next = i + 1 < map->nr ? &map->ext[i + 1] : NULL;
+
+  if (prev && prev->lblk + prev->len == lblk && prev->pblk + prev->len == pblk) {
+    ++prev->len;
+    if (next && next->lblk == lblk + 1 && next->pblk == pblk + 1) {
+      prev->len += next->len;
+      for (int j = i + 1; j + 1 < map->nr; ++j) map->ext[j] = map->ext[j + 1];
+      --map->nr;
+    }
+    return;
+  }
+  if (next && next->lblk == lblk + 1 && next->pblk == pblk + 1) {
+    --next->lblk;
+    --next->pblk;
+    ++next->len;
+    return;
+  }
+
+  if (map->nr == map->cap) {
+    map->cap = map->cap ? map->cap * 2 : NR_INLINE_EXTENTS;
+    naivefs_extent_t *ext = pmm->alloc(map->cap * sizeof(naivefs_extent_t));
+    for (int j = 0; j < map->nr; ++j) ext[j] = map->ext[j];
+    if (map->ext) pmm->free(map->ext);
+    map->ext = ext;
+  }
+  for (int j = map->nr; j > i + 1; --j) map->ext[j] = map->ext[j - 1];
+  map->ext[i + 1] = (naivefs_extent_t) { lblk, pblk, 1 };
+  ++map->nr;
+}
+
+naivefs_emap_t *naivefs_emap_load(filesystem_t *fs, naivefs_dinode_t *d) {
+  naivefs_emap_t *map = pmm->alloc(sizeof(naivefs_emap_t));
+  map->nr = map->cap = d->nr_extents;
+  map->disk_blk = d->ext_blk;
+  map->disk_cap = d->ext_cap;
+  if (map->nr == 0) return map;
+
+  map->ext = pmm->alloc(map->cap * sizeof(naivefs_extent_t));
+  if (map->nr <= NR_INLINE_EXTENTS) {
+    for (int i = 0; i < map->nr; ++i) map->ext[i] = d->extents[i];
+  } else {
+    pcache_read(fs->dev, naivefs_blk_offset(fs, map->disk_blk),
+        (void *)map->ext, map->nr * sizeof(naivefs_extent_t));
+  }
+  return map;
+}
+
+void naivefs_emap_free(naivefs_emap_t *map) {
+  if (map->ext) pmm->free(map->ext);
+  if (map->index) naivefs_dindex_free(map->index);
+  pmm->free(map);
+}
+
+static inline int32_t naivefs_ext_blks(filesystem_t *fs, int32_t cap) {
+  int32_t bs = naivefs_params(fs)->blk_size;
+  return (cap * sizeof(naivefs_extent_t) + bs - 1) / bs;
+}
+
+void naivefs_release_blks(filesystem_t *fs, inode_t *ip) {
+  naivefs_emap_t *map = ip->ptr;
+  if (ip->type != TYPE_FILE || map->disk_cap) naivefs_revoke(fs);
+  for (int i = 0; i < map->nr; ++i) {
+    naivefs_free_blks(fs, map->ext[i].pblk, map->ext[i].len);
+  }
+  if (map->disk_cap) {
+    naivefs_free_blks(fs, map->disk_blk, naivefs_ext_blks(fs, map->disk_cap));
+  }
+  map->nr = 0;
+  map->disk_blk = map->disk_cap = 0;
+}
+
+void naivefs_sync_inode(filesystem_t *fs, inode_t *ip) {
+  naivefs_dinode_t d = {};
+  d.type = (int16_t)ip->type;
+  d.flags = (int16_t)ip->flags;
+  d.parent = ip->blk && ip->parent ? ip->parent->blk : 0;
+
+  if (ip->type == TYPE_LINK) {
+    d.link = ((inode_t *)ip->ptr)->blk;
+  } else {
+    naivefs_emap_t *map = ip->ptr;
+    d.size = (int32_t)ip->size;
+    d.nr_extents = map->nr;
+    if (map->nr <= NR_INLINE_EXTENTS) {
+      for (int i = 0; i < map->nr; ++i) d.extents[i] = map->ext[i];
+    } else {
+      if (map->disk_cap < map->nr) {
+        // move the extents to a bigger run and give the old one back
+        int32_t n = naivefs_ext_blks(fs, map->cap);
+        int32_t blk = naivefs_alloc_blks(fs, 0, n);
+        if (blk) {
+          if (map->disk_cap) {
+            naivefs_free_blks(fs, map->disk_blk, naivefs_ext_blks(fs, map->disk_cap));
+            naivefs_revoke(fs);
+          }
+          map->disk_blk = blk;
+          map->disk_cap = n * naivefs_params(fs)->blk_size / sizeof(naivefs_extent_t);
+        }
+      }
+      Assert(map->disk_cap >= map->nr, "naivefs: no space for the extent map");
+      naivefs_meta_write(fs, naivefs_blk_offset(fs, map->disk_blk),
+          (void *)map->ext, map->nr * sizeof(naivefs_extent_t));
+    }
+    d.ext_blk = map->disk_blk;
+    d.ext_cap = map->disk_cap;
+  }
+  naivefs_put_dinode(fs, ip->blk, &d);
+}
+
+inode_t *naivefs_new_inode(filesystem_t *fs, int type, int flags, int32_t ino, const char *path) {
+  inode_t *ip = pmm->alloc(sizeof(inode_t));
+  ip->refcnt = 0;
+  ip->type = type;
+  ip->flags = flags;
+  ip->blk = ino;
+  sprintf(ip->path, "%s", path);
+  spinlock_init(&ip->lock, "naivefs inode lock");
+  ip->size = 0;
+  ip->fs = fs;
+  ip->ops = pmm->alloc(sizeof(inodeops_t));
+  memcpy(ip->ops, &naive_ops, sizeof(inodeops_t));
+  ip->parent = NULL;
+  ip->fchild = NULL;
+  ip->cousin = NULL;
+  return ip;
+}
+
+void naivefs_free_inode(inode_t *ip) {
+  if (ip->type != TYPE_LINK && ip->ptr) naivefs_emap_free(ip->ptr);
+  pmm->free(ip->ops);
+  pmm->free(ip);
+}
+
+// Inode cache
+// -------------------------------------------------------------------
+
+static inline void naivefs_lru_unlink(naivefs_icache_t *ic) {
+  ic->prev->next = ic->next;
+  ic->next->prev = ic->prev;
+}
+
+static inline void naivefs_lru_push(naivefs_info_t *info, naivefs_icache_t *ic) {
+  ic->next = info->lru.next;
+  ic->prev = &info->lru;
+  info->lru.next->prev = ic;
+  info->lru.next = ic;
+}
+
+static naivefs_icache_t *naivefs_icache_find(filesystem_t *fs, int32_t ino) {
+  naivefs_info_t *info = fs->ptr;
+  for (naivefs_icache_t *ic = info->icache[ino % NR_ICACHE_BUCKETS]; ic != NULL; ic = ic->hnext) {
+    if (ic->ino == ino) return ic;
+  }
+  return NULL;
+}
+
+static void naivefs_icache_touch(filesystem_t *fs, inode_t *ip) {
+  naivefs_icache_t *ic = naivefs_icache_find(fs, ip->blk);
+  if (!ic) return;
+  naivefs_lru_unlink(ic);
+  naivefs_lru_push(fs->ptr, ic);
+}
+
+static void naivefs_icache_add(filesystem_t *fs, inode_t *ip) {
+  naivefs_info_t *info = fs->ptr;
+  naivefs_icache_t *ic = pmm->alloc(sizeof(naivefs_icache_t));
+  ic->ino = ip->blk;
+  ic->inode = ip;
+  ic->hnext = info->icache[ip->blk % NR_ICACHE_BUCKETS];
+  info->icache[ip->blk % NR_ICACHE_BUCKETS] = ic;
+  naivefs_lru_push(info, ic);
+  ++info->nr_cached;
+}
+
+static void naivefs_icache_del(filesystem_t *fs, inode_t *ip) {
+  naivefs_info_t *info = fs->ptr;
+  naivefs_icache_t **pp = &info->icache[ip->blk % NR_ICACHE_BUCKETS];
+  while (*pp && (*pp)->inode != ip) pp = &(*pp)->hnext;
+  if (!*pp) return;
+  naivefs_icache_t *ic = *pp;
+  *pp = ic->hnext;
+  naivefs_lru_unlink(ic);
+  pmm->free(ic);
+  --info->nr_cached;
+}
+
+static void naivefs_pin(filesystem_t *fs, inode_t *ip, int delta) {
+  naivefs_icache_t *ic = naivefs_icache_find(fs, ip->blk);
+  if (ic) ic->pins += delta;
+}
+
+static inline bool naivefs_orphan(inode_t *ip) {
+  // unlinked while open or linked to, it keeps its ino and blocks until
+  // the last of those goes
+  return ip->parent == NULL && ip->blk != 0;
+}
+
+static bool naivefs_unpin(filesystem_t *fs, inode_t *ip);
+
+static bool naivefs_reap(filesystem_t *fs, inode_t *ip) {
+  // caller holds fs->lock, frees an orphan nothing refers to any more and
+  // returns whether it did
+  naivefs_icache_t *ic = naivefs_icache_find(fs, ip->blk);
+  if (!naivefs_orphan(ip) || ip->refcnt > 0 || (ic && ic->pins > 0)) return false;
+  naivefs_begin(fs);
+  if (ip->type != TYPE_LINK) naivefs_release_blks(fs, ip);
+  naivefs_free_ino(fs, ip->blk);
+  naivefs_end(fs);
+  naivefs_icache_del(fs, ip);
+  if (ip->type == TYPE_LINK) naivefs_unpin(fs, ip->ptr);
+  naivefs_free_inode(ip);
+  return true;
+}
+
+static bool naivefs_unpin(filesystem_t *fs, inode_t *ip) {
+  // a loaded link lets go of ip, an orphan goes with its last link
+  naivefs_pin(fs, ip, -1);
+  return naivefs_reap(fs, ip);
+}
+
+static void naivefs_icache_shrink(filesystem_t *fs) {
+  // caller holds fs->lock and no inode of its own yet; everything is
+  // written through, so any leaf that is neither open nor linked to can go
+  naivefs_info_t *info = fs->ptr;
+  naivefs_icache_t *ic = info->lru.prev;
+  while (info->nr_cached > NR_NAIVEFS_ICACHE && ic != &info->lru) {
+    naivefs_icache_t *prev = ic->prev;
+    inode_t *ip = ic->inode;
+    if (ip->refcnt <= 0 && !ip->fchild && ic->pins == 0) {
+      inode_remove(ip->parent, ip);
+      naivefs_icache_del(fs, ip);
+      // orphans that go along with a link may include prev
+      if (ip->type == TYPE_LINK && naivefs_unpin(fs, ip->ptr)) prev = info->lru.prev;
+      naivefs_free_inode(ip);
+    }
+    ic = prev;
+  }
+}
+
 const char *inode_types_human[] = {
   "INVL",
   "MNTP",
@@ -108,7 +912,13 @@ inodeops_t naive_ops = {
   .close   = naive_close,
   .read    = naive_read,
   .write   = naive_write,
+  .pread   = naive_pread,
+  .pwrite  = naive_pwrite,
+  .readv   = naive_readv,
+  .writev  = naive_writev,
   .lseek   = naive_lseek,
+  .get_page = naive_get_page,
+  .ioctl   = naive_ioctl,
   .mkdir   = naive_mkdir,
   .rmdir   = naive_rmdir,
   .link    = naive_link,
@@ -120,6 +930,8 @@ fsops_t naivefs_ops = {
   .init   = naivefs_init,
   .lookup = naivefs_lookup,
   .close  = naivefs_close,
+  .fetch  = naivefs_fetch,
+  .sync   = naivefs_sync,
 };
 
 filesystem_t naivefs = {
@@ -138,87 +950,485 @@ filesystem_t emptyfs = {
 
 int naive_open(filesystem_t *fs, file_t *file, int flags) {
   if ((flags & file->inode->flags) != (flags & ~O_CREAT)) return E_BADPR;
-  file->inode->offset = 0;
+  file->offset = 0;
   return 0;
 }
 
 int naive_close(filesystem_t *fs, file_t *file) {
-  if (file->inode->offset > file->inode->size) {
-    file->inode->size = file->inode->offset;
-  }
-  file->inode->offset = 0;
+  file->offset = 0;
   return fs->ops->close(file->inode);
 }
 
-ssize_t naive_read(filesystem_t *fs, file_t *file, char *buf, size_t size) {
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  inode_t *ip = file->inode;
-  while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
-  off_t offset = ip->offset;
-  int32_t blk = ip->blk;
-  
-  while (offset >= params->blk_size) {
-    offset -= params->blk_size;
-    blk = naivefs_get_next_blk(fs, blk);
-    if (blk == 0) return 0;
-  }
+static ssize_t naivefs_do_read(filesystem_t *fs, inode_t *ip, char *buf, size_t size, off_t offset) {
+  // caller holds ip->lock, copies whole contiguous runs at a time
+  naivefs_params_t *params = naivefs_params(fs);
+  naivefs_emap_t *map = ip->ptr;
+  if (offset >= ip->size) return 0;
+  if (size > ip->size - offset) size = ip->size - offset;
 
   ssize_t nread = 0;
-  while (blk != 0 && size > 0) {
-    naivefs_entry_t entry = naivefs_get_entry(fs, blk);
-    ssize_t delta = 0;
-    if (params->blk_size - offset >= size) {
-      delta = snprintf(buf + nread, size, "%s", entry.content + offset);
+  while (size > 0) {
+    int32_t lblk = offset / params->blk_size;
+    off_t in = offset % params->blk_size;
+    int32_t run = 1;
+    int32_t pblk = naivefs_bmap(map, lblk, &run);
+
+    size_t len = (size_t)run * params->blk_size - in;
+    if (len > size) len = size;
+    if (pblk) {
+      pcache_read(fs->dev, naivefs_blk_offset(fs, pblk) + in, buf + nread, len);
     } else {
-      delta = snprintf(buf + nread, params->blk_size - offset, "%s", entry.content + offset);
+      memset(buf + nread, 0, len); // hole
     }
-    if (delta == 0) break;
-    size -= delta;
-    nread += delta;
-    
-    offset = 0;
-    blk = naivefs_get_next_blk(fs, blk);
+    size -= len;
+    nread += len;
+    offset += len;
   }
   return nread;
 }
 
+static size_t naivefs_do_map(filesystem_t *fs, inode_t *ip, off_t offset, size_t size) {
+  // caller holds ip->lock inside a transaction, maps every block of the
+  // range so the copy sees the longest runs, returns how much got mapped
+  naivefs_params_t *params = naivefs_params(fs);
+  naivefs_emap_t *map = ip->ptr;
+  if (size == 0) return 0;
+
+  bool grown = false;
+  int32_t first = offset / params->blk_size;
+  int32_t last = (offset + size - 1) / params->blk_size;
+  for (int32_t lblk = first; lblk <= last; ++lblk) {
+    if (naivefs_bmap(map, lblk, NULL)) continue;
+    // overwrites stay in place, new blocks go right after the previous one
+    int32_t prev = lblk > 0 ? naivefs_bmap(map, lblk - 1, NULL) : 0;
+    int32_t pblk = naivefs_alloc_blks(fs, prev ? prev + 1 : 0, 1);
+    if (pblk == 0) {
+      if ((off_t)lblk * params->blk_size <= offset) return 0;
+      size = (off_t)lblk * params->blk_size - offset;
+      break;
+    }
+    naivefs_emap_insert(map, lblk, pblk);
+    grown = true;
+    off_t lo = (off_t)lblk * params->blk_size, hi = lo + params->blk_size;
+    if (lo < offset || hi > offset + size) naivefs_zero_blks(fs, pblk, 1);
+  }
+  if (grown) naivefs_sync_inode(fs, ip);
+  return size;
+}
+
+static void naivefs_do_copy(filesystem_t *fs, inode_t *ip, const char *buf, size_t size, off_t offset) {
+  // caller holds ip->lock, every block of the range is mapped
+  naivefs_params_t *params = naivefs_params(fs);
+  naivefs_emap_t *map = ip->ptr;
+  size_t nwrite = 0;
+  while (nwrite < size) {
+    int32_t lblk = (offset + nwrite) / params->blk_size;
+    off_t in = (offset + nwrite) % params->blk_size;
+    int32_t run = 1;
+    int32_t pblk = naivefs_bmap(map, lblk, &run);
+    size_t len = (size_t)run * params->blk_size - in;
+    if (len > size - nwrite) len = size - nwrite;
+    off_t where = naivefs_blk_offset(fs, pblk) + in;
+    if (ip->type == TYPE_FILE) {
+      pcache_write(fs->dev, where, buf + nwrite, len);
+    } else {
+      naivefs_meta_write(fs, where, buf + nwrite, len); // directory entries
+    }
+    nwrite += len;
+  }
+}
+
+static ssize_t naivefs_do_write(filesystem_t *fs, inode_t *ip, const char *buf, size_t size, off_t offset) {
+  // caller holds ip->lock inside a transaction
+  size = naivefs_do_map(fs, ip, offset, size);
+  naivefs_do_copy(fs, ip, buf, size, offset);
+  if (offset + size > ip->size) {
+    ip->size = offset + size;
+    naivefs_sync_inode(fs, ip);
+  }
+  return size;
+}
+
+static ssize_t naivefs_file_write(filesystem_t *fs, inode_t *ip, const struct iovec *iov, int iovcnt, off_t offset) {
+  // the journal is held while the blocks get mapped and while the new
+  // size is logged, the data goes in under the inode lock alone
+  size_t size = 0;
+  for (int i = 0; i < iovcnt; ++i) size += iov[i].iov_len;
+  naivefs_begin(fs);
+  spinlock_acquire(&ip->lock);
+  size = naivefs_do_map(fs, ip, offset, size);
+  spinlock_release(&ip->lock);
+  naivefs_end(fs);
+  if (size == 0) return 0;
+
+  // the whole vector is copied under one lock, so it lands contiguously
+  spinlock_acquire(&ip->lock);
+  size_t done = 0;
+  for (int i = 0; i < iovcnt && done < size; ++i) {
+    size_t len = iov[i].iov_len < size - done ? iov[i].iov_len : size - done;
+    naivefs_do_copy(fs, ip, iov[i].iov_base, len, offset + done);
+    done += len;
+  }
+  spinlock_release(&ip->lock);
+
+  naivefs_begin(fs);
+  spinlock_acquire(&ip->lock);
+  if (offset + size > ip->size) {
+    ip->size = offset + size;
+    naivefs_sync_inode(fs, ip);
+  }
+  spinlock_release(&ip->lock);
+  naivefs_end(fs);
+  return size;
+}
+
+// Directories
+// -------------------------------------------------------------------
+
+static inline uint32_t naivefs_name_hash(const char *name, size_t len) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t naivefs_dir_scan(filesystem_t *fs, inode_t *dir, int32_t lblk, char *blk, naivefs_dindex_t *idx) {
+  // caller holds dir->lock, reads block lblk into blk and returns its
+  // largest gap, indexing the entries on the way when idx is given
+  int32_t bs = naivefs_params(fs)->blk_size;
+  naivefs_do_read(fs, dir, blk, bs, (off_t)lblk * bs);
+  uint32_t room = 0;
+  for (int32_t off = 0; off < bs; ) {
+    naivefs_dirent_t *de = (naivefs_dirent_t *)(blk + off);
+    if (de->rec_len == 0) break;
+    size_t used = de->ino ? NAIVEFS_DIRENT_SIZE(de->name_len) : 0;
+    if (de->rec_len - used > room) room = de->rec_len - used;
+    if (idx && de->ino) naivefs_dindex_add(idx, de->hash, de->ino, (off_t)lblk * bs + off);
+    off += de->rec_len;
+  }
+  return room;
+}
+
+static naivefs_dindex_t *naivefs_dir_index(filesystem_t *fs, inode_t *dir) {
+  // caller holds dir->lock, only the first call reads the blocks
+  naivefs_emap_t *map = dir->ptr;
+  if (map->index) return map->index;
+  int32_t bs = naivefs_params(fs)->blk_size;
+  naivefs_dindex_t *idx = pmm->alloc(sizeof(naivefs_dindex_t));
+  naivefs_dindex_resize(idx, NR_DINDEX_BUCKETS);
+  char *blk = pmm->alloc(bs);
+  for (int32_t lblk = 0; (off_t)lblk * bs < dir->size; ++lblk) {
+    naivefs_dindex_set_room(idx, lblk, naivefs_dir_scan(fs, dir, lblk, blk, idx));
+  }
+  pmm->free(blk);
+  map->index = idx;
+  return idx;
+}
+
+static int naivefs_dir_entry(filesystem_t *fs, inode_t *dir, off_t off, char *name) {
+  // caller holds dir->lock, copies out the name of the record at off
+  int32_t bs = naivefs_params(fs)->blk_size;
+  uint32_t rec[NAIVEFS_DIRENT_SIZE(NAIVEFS_NAME_LEN) / sizeof(uint32_t)];
+  size_t n = sizeof(rec);
+  if (n > bs - off % bs) n = bs - off % bs;
+  naivefs_do_read(fs, dir, (char *)rec, n, off);
+  naivefs_dirent_t *de = (naivefs_dirent_t *)rec;
+  if (sizeof(naivefs_dirent_t) + de->name_len > n) return -1;
+  memcpy(name, de->name, de->name_len);
+  name[de->name_len] = '\0';
+  return de->name_len;
+}
+
+static int naivefs_dir_add(filesystem_t *fs, inode_t *dir, const char *name, size_t len, int32_t ino, int type) {
+  // caller holds dir->lock, fills the first gap big enough or starts a new block
+  int32_t bs = naivefs_params(fs)->blk_size;
+  size_t need = NAIVEFS_DIRENT_SIZE(len);
+  naivefs_dindex_t *idx = naivefs_dir_index(fs, dir);
+  char *blk = pmm->alloc(bs);
+  off_t at = dir->size;
+  uint32_t rec_len = bs;
+  int32_t lblk = 0;
+  while (lblk < idx->nr_blks && idx->room[lblk] < need) ++lblk;
+  if (lblk < idx->nr_blks) {
+    off_t base = (off_t)lblk * bs;
+    naivefs_do_read(fs, dir, blk, bs, base);
+    for (int32_t off = 0; off < bs; ) {
+      naivefs_dirent_t *de = (naivefs_dirent_t *)(blk + off);
+      if (de->rec_len == 0) break;
+      size_t used = de->ino ? NAIVEFS_DIRENT_SIZE(de->name_len) : 0;
+      if (de->rec_len - used >= need) {
+        at = base + off + used;
+        rec_len = de->rec_len - used;
+        if (used) {
+          de->rec_len = used;
+          naivefs_do_write(fs, dir, (char *)de, sizeof(naivefs_dirent_t), base + off);
+        }
+        break;
+      }
+      off += de->rec_len;
+    }
+  }
+
+  uint32_t rec[NAIVEFS_DIRENT_SIZE(NAIVEFS_NAME_LEN) / sizeof(uint32_t)] = {};
+  naivefs_dirent_t *de = (naivefs_dirent_t *)rec;
+  de->ino = ino;
+  de->hash = naivefs_name_hash(name, len);
+  de->rec_len = rec_len;
+  de->name_len = len;
+  de->type = type;
+  memcpy(de->name, name, len);
+  if (naivefs_do_write(fs, dir, (char *)rec, need, at) < need) {
+    pmm->free(blk);
+    return E_TOOLG;
+  }
+  if (dir->size < at + rec_len) {
+    dir->size = at + rec_len;
+    naivefs_sync_inode(fs, dir);
+  }
+  naivefs_dindex_add(idx, de->hash, ino, at);
+  naivefs_dindex_set_room(idx, at / bs, naivefs_dir_scan(fs, dir, at / bs, blk, NULL));
+  pmm->free(blk);
+  return 0;
+}
+
+static void naivefs_dir_remove(filesystem_t *fs, inode_t *dir, int32_t ino) {
+  // caller holds dir->lock, merges the record into the one before it
+  int32_t bs = naivefs_params(fs)->blk_size;
+  naivefs_dindex_t *idx = naivefs_dir_index(fs, dir);
+  naivefs_dslot_t *s = naivefs_dindex_find(idx, ino);
+  if (!s) return;
+  int32_t lblk = s->off / bs;
+  off_t base = (off_t)lblk * bs;
+  int32_t in = s->off - base, prev = -1;
+  char *blk = pmm->alloc(bs);
+  naivefs_do_read(fs, dir, blk, bs, base);
+  for (int32_t off = 0; off < in; ) {
+    naivefs_dirent_t *de = (naivefs_dirent_t *)(blk + off);
+    if (de->rec_len == 0) break;
+    prev = off;
+    off += de->rec_len;
+  }
+  naivefs_dirent_t *de = (naivefs_dirent_t *)(blk + in);
+  if (prev >= 0) {
+    naivefs_dirent_t *pe = (naivefs_dirent_t *)(blk + prev);
+    pe->rec_len += de->rec_len;
+    naivefs_do_write(fs, dir, (char *)pe, sizeof(naivefs_dirent_t), base + prev);
+  } else {
+    de->ino = 0;
+    naivefs_do_write(fs, dir, (char *)de, sizeof(naivefs_dirent_t), s->off);
+  }
+  naivefs_dindex_del(idx, s);
+  naivefs_dindex_set_room(idx, lblk, naivefs_dir_scan(fs, dir, lblk, blk, NULL));
+  pmm->free(blk);
+}
+
+static int32_t naivefs_dir_lookup(filesystem_t *fs, inode_t *dir, const char *name, size_t len) {
+  // caller holds dir->lock, returns the inode named name or 0
+  uint32_t hash = naivefs_name_hash(name, len);
+  naivefs_dindex_t *idx = naivefs_dir_index(fs, dir);
+  naivefs_dslot_t *s = idx->by_hash[hash & (idx->nr_buckets - 1)];
+  for (; s; s = s->hnext) {
+    char buf[NAIVEFS_NAME_LEN + 1];
+    if (s->hash != hash) continue;
+    if (naivefs_dir_entry(fs, dir, s->off, buf) == len && !strncmp(buf, name, len)) return s->ino;
+  }
+  return 0;
+}
+
+static int naivefs_dir_name(filesystem_t *fs, inode_t *dir, int32_t ino, char *name) {
+  // caller holds dir->lock, copies out the name of ino and returns its length
+  naivefs_dslot_t *s = naivefs_dindex_find(naivefs_dir_index(fs, dir), ino);
+  return s ? naivefs_dir_entry(fs, dir, s->off, name) : -1;
+}
+
+static bool naivefs_dir_empty(filesystem_t *fs, inode_t *dir) {
+  // caller holds dir->lock
+  return naivefs_dir_index(fs, dir)->nr == 0;
+}
+
+static inode_t *naivefs_iget(filesystem_t *fs, int32_t ino);
+
+static inode_t *naivefs_instantiate(filesystem_t *fs, inode_t *dir, const char *name, size_t len, int32_t ino) {
+  // caller holds fs->lock, brings the entry name -> ino of dir into memory
+  size_t plen = strlen(dir->path);
+  if (dir->path[plen - 1] == '/') --plen;
+  if (plen + 1 + len >= sizeof(dir->path)) return NULL;
+
+  naivefs_dinode_t d;
+  naivefs_get_dinode(fs, ino, &d);
+  if (d.type != TYPE_DIRC && d.type != TYPE_FILE && d.type != TYPE_LINK) return NULL;
+  inode_t *target = NULL;
+  if (d.type == TYPE_LINK) {
+    target = d.link != ino ? naivefs_iget(fs, d.link) : NULL;
+    if (!target || (target->type != TYPE_FILE && target->type != TYPE_LINK)) {
+      // dangling links are dropped
+      naivefs_begin(fs);
+      spinlock_acquire(&dir->lock);
+      naivefs_dir_remove(fs, dir, ino);
+      spinlock_release(&dir->lock);
+      naivefs_free_ino(fs, ino);
+      naivefs_end(fs);
+      return NULL;
+    }
+  }
+
+  char full[256];
+  memcpy(full, dir->path, plen);
+  full[plen] = '/';
+  memcpy(full + plen + 1, name, len);
+  full[plen + 1 + len] = '\0';
+
+  inode_t *ip = naivefs_new_inode(fs, d.type, d.flags, ino, full);
+  if (target) {
+    ip->ptr = (void *)target;
+    ip->size = sizeof(void *);
+    naivefs_pin(fs, target, 1);
+  } else {
+    ip->ptr = naivefs_emap_load(fs, &d);
+    ip->size = d.size;
+  }
+  ip->parent = dir;
+  inode_insert(dir, ip);
+  naivefs_icache_add(fs, ip);
+  return ip;
+}
+
+static inode_t *naivefs_iget(filesystem_t *fs, int32_t ino) {
+  // caller holds fs->lock, loads ino together with any missing ancestors
+  if (ino == 0) return fs->root;
+  if (ino < 0 || ino >= naivefs_params(fs)->ino_top) return NULL;
+  naivefs_icache_t *ic = naivefs_icache_find(fs, ino);
+  if (ic) return ic->inode;
+
+  naivefs_dinode_t d;
+  naivefs_get_dinode(fs, ino, &d);
+  if (d.type != TYPE_DIRC && d.type != TYPE_FILE && d.type != TYPE_LINK) return NULL;
+  inode_t *dir = d.parent != ino ? naivefs_iget(fs, d.parent) : NULL;
+  if (!dir || (dir->type != TYPE_DIRC && dir->type != TYPE_MNTP)) return NULL;
+
+  char name[NAIVEFS_NAME_LEN + 1];
+  spinlock_acquire(&dir->lock);
+  int len = naivefs_dir_name(fs, dir, ino, name);
+  spinlock_release(&dir->lock);
+  return len > 0 ? naivefs_instantiate(fs, dir, name, len, ino) : NULL;
+}
+
+inode_t *naivefs_fetch(filesystem_t *fs, inode_t *dir, const char *name, size_t len) {
+  // caller holds fs->lock, looks name up in the directory blocks of dir
+  if (dir->fs != fs || (dir->type != TYPE_DIRC && dir->type != TYPE_MNTP)) return NULL;
+  if (len == 0 || len > NAIVEFS_NAME_LEN) return NULL;
+  spinlock_acquire(&dir->lock);
+  int32_t ino = naivefs_dir_lookup(fs, dir, name, len);
+  spinlock_release(&dir->lock);
+  return ino > 0 ? naivefs_instantiate(fs, dir, name, len, ino) : NULL;
+}
+
+static inode_t *naivefs_create(filesystem_t *fs, inode_t *pp, const char *path, int type, int flags, inode_t *target) {
+  // caller holds fs->lock, path names a new entry right below pp
+  if (pp->fs != fs || (pp->type != TYPE_DIRC && pp->type != TYPE_MNTP)) return NULL;
+  const char *name = path + strlen(pp->path);
+  while (*name == '/') ++name;
+  size_t len = strlen(name);
+  if (len == 0 || len > NAIVEFS_NAME_LEN || strlen(path) >= sizeof(pp->path)) return NULL;
+
+  naivefs_begin(fs);
+  int32_t ino = naivefs_alloc_ino(fs);
+  if (ino < 0) {
+    naivefs_end(fs);
+    return NULL;
+  }
+  inode_t *ip = naivefs_new_inode(fs, type, flags, ino, path);
+  ip->parent = pp;
+  if (type == TYPE_LINK) {
+    ip->ptr = (void *)target;
+    ip->size = sizeof(void *);
+  } else {
+    ip->ptr = pmm->alloc(sizeof(naivefs_emap_t));
+  }
+  naivefs_sync_inode(fs, ip);
+
+  spinlock_acquire(&pp->lock);
+  int ret = naivefs_dir_add(fs, pp, name, len, ino, type);
+  spinlock_release(&pp->lock);
+  if (ret < 0) {
+    naivefs_free_ino(fs, ino);
+    naivefs_end(fs);
+    naivefs_free_inode(ip);
+    return NULL;
+  }
+  naivefs_end(fs);
+  inode_insert(pp, ip);
+  naivefs_icache_add(fs, ip);
+  if (type == TYPE_LINK) naivefs_pin(fs, target, 1);
+  return ip;
+}
+
+static void naivefs_destroy(filesystem_t *fs, inode_t *ip) {
+  // caller holds fs->lock, ip has no children; the name goes now, the
+  // inode once no open file or loaded link refers to it, as a write
+  // copies into the blocks it mapped without the journal
+  inode_t *pp = ip->parent;
+  naivefs_begin(fs);
+  spinlock_acquire(&pp->lock);
+  naivefs_dir_remove(fs, pp, ip->blk);
+  spinlock_release(&pp->lock);
+  inode_remove(pp, ip);
+  ip->parent = NULL;
+  naivefs_reap(fs, ip);
+  naivefs_end(fs);
+}
+
+ssize_t naive_read(filesystem_t *fs, file_t *file, char *buf, size_t size) {
+  ssize_t nread = naive_pread(fs, file, buf, size, file->offset);
+  if (nread > 0) file->offset += nread;
+  return nread;
+}
+
 ssize_t naive_write(filesystem_t *fs, file_t *file, const char *buf, size_t size) {
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
+  ssize_t nwrite = naive_pwrite(fs, file, buf, size, file->offset);
+  if (nwrite > 0) file->offset += nwrite;
+  return nwrite;
+}
+
+ssize_t naive_pread(filesystem_t *fs, file_t *file, char *buf, size_t size, off_t offset) {
   inode_t *ip = file->inode;
   while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
-  off_t offset = ip->offset;
-  int32_t blk = ip->blk;
-  
-  while (offset >= params->blk_size) {
-    offset -= params->blk_size;
-    blk = naivefs_get_next_blk(fs, blk);
-    if (blk == 0) return 0;
-  }
-
-  ssize_t nwrite = 0;
-  while (blk != 0 && size > 0) {
-    naivefs_entry_t entry = naivefs_get_entry(fs, blk);
-    ssize_t delta = 0;
-    if (params->blk_size - offset >= size) {
-      delta = snprintf(entry.content + offset, size, "%s", buf + nwrite);
-    } else {
-      delta = snprintf(entry.content + offset, params->blk_size - offset, "%s", buf + nwrite);
-    }
-    naivefs_put_entry(fs, blk, &entry);
-    if (delta == 0) break;
-    size -= delta;
-    nwrite += delta;
-    
-    offset = 0;
-    naivefs_add_map(fs, blk, params->min_free);
-    blk = params->min_free;
-    ++params->min_free;
-  }
-  
-  ip->offset += nwrite;
-  if (ip->offset > ip->size) {
-    ip->size = ip->offset;
+  spinlock_acquire(&ip->lock);
+  ssize_t nread = naivefs_do_read(fs, ip, buf, size, offset);
+  spinlock_release(&ip->lock);
+  return nread;
+}
+
+ssize_t naive_pwrite(filesystem_t *fs, file_t *file, const char *buf, size_t size, off_t offset) {
+  inode_t *ip = file->inode;
+  while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
+  struct iovec iov = { (void *)buf, size };
+  return naivefs_file_write(fs, ip, &iov, 1, offset);
+}
+
+ssize_t naive_readv(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt) {
+  inode_t *ip = file->inode;
+  while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
+  ssize_t nread = 0;
+  spinlock_acquire(&ip->lock);
+  for (int i = 0; i < iovcnt; ++i) {
+    ssize_t delta = naivefs_do_read(fs, ip, iov[i].iov_base, iov[i].iov_len, file->offset + nread);
+    nread += delta;
+    if (delta < iov[i].iov_len) break;
   }
+  spinlock_release(&ip->lock);
+  file->offset += nread;
+  return nread;
+}
+
+ssize_t naive_writev(filesystem_t *fs, file_t *file, const struct iovec *iov, int iovcnt) {
+  inode_t *ip = file->inode;
+  while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
+  ssize_t nwrite = naivefs_file_write(fs, ip, iov, iovcnt, file->offset);
+  file->offset += nwrite;
   return nwrite;
 }
 
@@ -227,49 +1437,71 @@ off_t naive_lseek(filesystem_t *fs, file_t *file, off_t offset, int whence) {
   while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
   switch (whence) {
     case SEEK_SET:
-      ip->offset = offset;
+      file->offset = offset;
       break;
     case SEEK_CUR:
-      ip->offset += offset;
+      file->offset += offset;
       break;
     case SEEK_END:
     default:
-      ip->offset = ip->size + offset;
+      file->offset = ip->size + offset;
       break;
   }
-  return ip->offset;
+  return file->offset;
+}
+
+ssize_t naive_get_page(filesystem_t *fs, file_t *file, off_t offset, const void **page) {
+  // maps at most one contiguous run of the file straight out of the device;
+  // only files opened read-only get a view, which later writes reach only
+  // once written back
+  static const char zeros[PCACHE_PAGE_SIZE] = {};
+  naivefs_params_t *params = naivefs_params(fs);
+  inode_t *ip = file->inode;
+  while (ip->type == TYPE_LINK) ip = (inode_t *)ip->ptr;
+  if (ip->type != TYPE_FILE) return E_BADTP;
+  if ((file->flags & O_RDWR) != O_RDONLY) return E_BADPR;
+  if (!fs->dev->ops->map) return E_BADFS;
+
+  // with the journal held no transaction is open, so the flush below
+  // finds none of its pages pinned
+  ssize_t ret = 0;
+  naivefs_begin(fs);
+  spinlock_acquire(&ip->lock);
+  if (offset < ip->size) {
+    int32_t run = 1;
+    int32_t pblk = naivefs_bmap(ip->ptr, offset / params->blk_size, &run);
+    off_t in = offset % params->blk_size;
+    size_t len = (size_t)run * params->blk_size - in;
+    if (len > ip->size - offset) len = ip->size - offset;
+    if (pblk) {
+      off_t pos = naivefs_blk_offset(fs, pblk) + in;
+      pcache_flush(fs->dev, pos, len);
+      *page = fs->dev->ops->map(fs->dev, pos, &len);
+      ret = *page ? len : E_BADFS;
+    } else {
+      *page = zeros; // hole
+      ret = len < sizeof(zeros) ? len : sizeof(zeros);
+    }
+  }
+  spinlock_release(&ip->lock);
+  naivefs_end(fs);
+  return ret;
+}
+
+int naive_ioctl(filesystem_t *fs, file_t *file, int request, void *arg) {
+  return E_BADTP;
 }
 
 int naive_mkdir(filesystem_t *fs, const char *path) {
+  naivefs_icache_shrink(fs);
   inode_t *pp = inode_search(fs->root, path);
   if (strlen(pp->path) == strlen(path)) return E_ALRDY;
+  for (size_t i = strlen(pp->path) + 1; i < strlen(path); ++i) {
+    if (path[i] == '/') return E_NOENT;
+  }
+  if (pp->type != TYPE_DIRC && pp->type != TYPE_MNTP) return E_BADTP;
 
-  naivefs_entry_t entry = {
-    .head = 0x00000000,
-    .type = TYPE_DIRC,
-    .flags = P_RD | P_WR,
-  };
-  if(strlen(path) - strlen(fs->root->path) >= 23) return E_TOOLG; // naivefs limitation
-  sprintf(entry.path, "%s", path + strlen(fs->root->path));
-  int32_t blk = naivefs_add_entry(fs, &entry);
-  
-  inode_t *ip = pmm->alloc(sizeof(inode_t));
-  ip->refcnt = 0;
-  ip->type = TYPE_DIRC;
-  ip->flags = P_RD | P_WR;
-  ip->blk = blk;
-  sprintf(ip->path, "%s", path);
-  ip->offset = 0;
-  ip->size = 4;
-  ip->fs = fs;
-  ip->ops = pmm->alloc(sizeof(inodeops_t));
-  memcpy(ip->ops, &naive_ops, sizeof(inodeops_t));
-
-  ip->parent = pp;
-  ip->fchild = NULL;
-  ip->cousin = NULL;
-  inode_insert(pp, ip);
-  return 0;
+  return naivefs_create(fs, pp, path, TYPE_DIRC, P_RD | P_WR, NULL) ? 0 : E_TOOLG;
 }
 
 int naive_rmdir(filesystem_t *fs, const char *path) {
@@ -277,51 +1509,26 @@ int naive_rmdir(filesystem_t *fs, const char *path) {
   if (!ip) return E_NOENT;
   if (ip->type != TYPE_DIRC) return E_BADTP;
   if (!(ip->flags & O_WRONLY)) return E_BADPR;
-  if (ip->fchild) return E_NOEMP;
-
-  int32_t blk = ip->blk;
-  naivefs_entry_t entry = naivefs_get_entry(fs, blk);
-  entry.type = TYPE_INVL;
-  naivefs_put_entry(fs, blk, &entry);
+  spinlock_acquire(&ip->lock);
+  bool empty = !ip->fchild && naivefs_dir_empty(fs, ip);
+  spinlock_release(&ip->lock);
+  if (!empty) return E_NOEMP;
 
-  inode_delete(ip);
-  pmm->free(ip->ops);
-  pmm->free(ip);
+  naivefs_destroy(fs, ip);
   return 0;
 }
 
 int naive_link(filesystem_t *fs, const char *path, inode_t *inode) {
   if (inode->type != TYPE_FILE && inode->type != TYPE_LINK) return E_BADTP;
-  inode_t *pp = inode_search(root, path);
+  inode_t *pp = inode_search(fs->root, path);
   if (strlen(pp->path) == strlen(path)) return E_ALRDY;
+  if (pp->type == TYPE_MNTP && pp != fs->root) return E_BADFS; // links stay within one fs
+  for (size_t i = strlen(pp->path) + 1; i < strlen(path); ++i) {
+    if (path[i] == '/') return E_NOENT;
+  }
+  if (pp->type != TYPE_DIRC && pp->type != TYPE_MNTP) return E_BADTP;
 
-  naivefs_entry_t entry = {
-    .head = inode->blk,
-    .type = TYPE_LINK,
-    .flags = P_RD | P_WR,
-  };
-  if(strlen(path) >= 23) return E_TOOLG; // naivefs limitation
-  sprintf(entry.path, "%s", path);
-  int32_t blk = naivefs_add_entry(fs, &entry);
-
-  inode_t *ip = pmm->alloc(sizeof(inode_t));
-  ip->refcnt = 0;
-  ip->type = TYPE_LINK;
-  ip->flags = P_RD | P_WR;
-  ip->ptr = (void *)inode;
-  ip->blk = blk;
-  sprintf(ip->path, "%s", path);
-  ip->offset = 0;
-  ip->size = sizeof(void *);
-  ip->fs = pp->fs;
-  ip->ops = pmm->alloc(sizeof(inodeops_t));
-  memcpy(ip->ops, &naive_ops, sizeof(inodeops_t));
-
-  ip->parent = pp;
-  ip->fchild = NULL;
-  ip->cousin = NULL;
-  inode_insert(pp, ip);
-  return 0;
+  return naivefs_create(fs, pp, path, TYPE_LINK, P_RD | P_WR, inode) ? 0 : E_TOOLG;
 }
 
 int naive_unlink(filesystem_t *fs, const char *path) {
@@ -330,52 +1537,91 @@ int naive_unlink(filesystem_t *fs, const char *path) {
   if (ip->type != TYPE_FILE && ip->type != TYPE_LINK) return E_BADTP;
   if (!(ip->flags & O_WRONLY)) return E_BADPR;
 
-  int32_t blk = ip->blk;
-  naivefs_entry_t entry = naivefs_get_entry(fs, blk);
-  entry.type = TYPE_INVL;
-  naivefs_put_entry(fs, blk, &entry);
-
-  inode_delete(ip);
-  pmm->free(ip->ops);
-  pmm->free(ip);
+  naivefs_destroy(fs, ip);
   return 0;
 }
 
+static void naivefs_readdir_line(char *ret, int type, int flags, size_t fsize, const char *path) {
+  strcat(ret, " - ");
+  strcat(ret, inode_types_human[type]);
+  strcat(ret, " ");
+
+  if (type == TYPE_DIRC || type == TYPE_MNTP) {
+    strcat(ret, "D ");
+  } else if (type == TYPE_LINK) {
+    strcat(ret, "L ");
+  } else {
+    strcat(ret, "- ");
+  }
+  strcat(ret, flags & P_RD ? "R" : "-");
+  strcat(ret, flags & P_WR ? "W" : "-");
+  strcat(ret, " ");
+
+  char size[8] = "";
+  if (type == TYPE_FILE || type == TYPE_LINK) {
+    snprintf(size, 4, "%04d", fsize);
+  } else {
+    snprintf(size, 4, "----");
+  }
+  strcat(ret, size);
+  strcat(ret, " ");
+
+  strcat(ret, path);
+  strcat(ret, "\n");
+}
+
 int naive_readdir(filesystem_t *fs, inode_t *inode, char *ret) {
   sprintf(ret, "ls %s:\n", inode->path);
   strcat(ret, " + TYPE PRIV SIZE FILENAME\n");
-  for (inode_t *ip = inode->fchild; ip != NULL; ip = ip->cousin) {
-    VFSCLog(FG_PURPLE, "%s %s", inode_types_human[ip->type], ip->path);
-    strcat(ret, " - ");
-    strcat(ret, inode_types_human[ip->type]);
-    strcat(ret, " ");
-
-    if (ip->type == TYPE_DIRC || ip->type == TYPE_MNTP) {
-      strcat(ret, "D ");
-    } else if (ip->type == TYPE_LINK) {
-      strcat(ret, "L ");
-    } else {
-      strcat(ret, "- ");
-    }
-    strcat(ret, ip->flags & P_RD ? "R" : "-");
-    strcat(ret, ip->flags & P_WR ? "W" : "-");
-    strcat(ret, " ");
+  bool on_disk = inode->fs->ops == &naivefs_ops
+    && (inode->type == TYPE_DIRC || inode->type == TYPE_MNTP);
 
-    char size[8] = "";
-    if (ip->type == TYPE_FILE) {
-      snprintf(size, 4, "%04d", ip->size);
-    } else if (ip->type == TYPE_LINK) {
-      inode_t *rip = ip;
-      while (rip->type == TYPE_LINK) rip = (inode_t *)rip->ptr;
-      snprintf(size, 4, "%04d", rip->size);
-    } else {
-      snprintf(size, 4, "----");
+  if (on_disk) {
+    // straight from the directory blocks, nothing gets instantiated
+    filesystem_t *dfs = inode->fs;
+    size_t plen = strlen(inode->path);
+    if (inode->path[plen - 1] == '/') --plen;
+    int32_t bs = naivefs_params(dfs)->blk_size;
+    char *blk = pmm->alloc(bs);
+    for (off_t base = 0; ; base += bs) {
+      // one block at a time, the lock is not held across the dinode reads
+      spinlock_acquire(&inode->lock);
+      bool more = base < inode->size;
+      if (more) naivefs_do_read(dfs, inode, blk, bs, base);
+      spinlock_release(&inode->lock);
+      if (!more) break;
+
+      for (int32_t off = 0; off < bs; ) {
+        naivefs_dirent_t *de = (naivefs_dirent_t *)(blk + off);
+        if (de->rec_len == 0) break;
+        off += de->rec_len;
+        if (!de->ino || plen + 1 + de->name_len >= sizeof(inode->path)) continue;
+
+        naivefs_dinode_t d, t;
+        naivefs_get_dinode(dfs, de->ino, &d);
+        t = d;
+        for (int i = 0; t.type == TYPE_LINK && i < NR_LINK_HOPS; ++i) {
+          naivefs_get_dinode(dfs, t.link, &t);
+        }
+        char full[256];
+        memcpy(full, inode->path, plen);
+        full[plen] = '/';
+        memcpy(full + plen + 1, de->name, de->name_len);
+        full[plen + 1 + de->name_len] = '\0';
+        VFSCLog(FG_PURPLE, "%s %s", inode_types_human[d.type], full);
+        naivefs_readdir_line(ret, d.type, d.flags, t.size, full);
+      }
     }
-    strcat(ret, size);
-    strcat(ret, " ");
+    pmm->free(blk);
+  }
 
-    strcat(ret, ip->path);
-    strcat(ret, "\n");
+  // mounted file systems only live in memory
+  for (inode_t *ip = inode->fchild; ip != NULL; ip = ip->cousin) {
+    if (on_disk && ip->fs == inode->fs) continue;
+    VFSCLog(FG_PURPLE, "%s %s", inode_types_human[ip->type], ip->path);
+    inode_t *rip = ip;
+    while (rip->type == TYPE_LINK) rip = (inode_t *)rip->ptr;
+    naivefs_readdir_line(ret, ip->type, ip->flags, rip->size, ip->path);
   }
   return 0;
 }
@@ -384,15 +1630,185 @@ void mount_naivefs() {
   device_t *dev = dev_lookup("ramdisk0");
   naivefs_init(&naivefs, "/", dev);
   VFSCLog(BG_YELLOW, "/ initialized.");
-  
+
   dev = dev_lookup("ramdisk1");
   naivefs_init(&emptyfs, "/mnt", dev);
   VFSCLog(BG_YELLOW, "/mnt initialized.");
   vfs->mount("/mnt", &emptyfs);
 }
 
+static void naivefs_format(filesystem_t *fs, device_t *dev, int32_t blk_size) {
+  naivefs_params_t *params = naivefs_params(fs);
+  off_t dev_size = dev->ops->size ? dev->ops->size(dev) : RD_SIZE;
+  params->magic     = NAIVEFS_MAGIC;
+  params->version   = NAIVEFS_VERSION;
+  params->blk_size  = blk_size;
+  params->nr_blks   = dev_size / params->blk_size;
+  params->itable    = (NAIVEFS_SUPER_SIZE + params->blk_size - 1) / params->blk_size;
+  // one inode per KiB of disk, within [16, 4096]
+  params->nr_inodes = dev_size / 1024;
+  if (params->nr_inodes < 16) params->nr_inodes = 16;
+  if (params->nr_inodes > 4096) params->nr_inodes = 4096;
+  params->ino_top   = 1;
+  params->free_ino  = 0;
+  params->bitmap    = params->itable
+    + (params->nr_inodes * sizeof(naivefs_dinode_t) + params->blk_size - 1) / params->blk_size;
+  params->journal   = params->bitmap
+    + (params->nr_blks / 8 + params->blk_size - 1) / params->blk_size;
+  // about a sixteenth of the disk for the journal
+  off_t jbytes = dev_size / 16;
+  if (jbytes < NAIVEFS_JNL_MIN) jbytes = NAIVEFS_JNL_MIN;
+  if (jbytes > NAIVEFS_JNL_MAX) jbytes = NAIVEFS_JNL_MAX;
+  params->journal_blks = (jbytes + params->blk_size - 1) / params->blk_size;
+  params->data_head = params->journal + params->journal_blks;
+  params->nr_free   = params->nr_blks;
+  params->goal      = params->data_head;
+  Assert(params->data_head < params->nr_blks, "naivefs: device too small");
+  naivefs_zero_blks(fs, params->itable, params->journal - params->itable);
+  naivefs_journal(fs)->size = params->journal_blks * params->blk_size;
+  naivefs_journal_reset(fs, 1);
+
+  // metadata and the tail of the last bitmap word are never free
+  naivefs_info_t *info = fs->ptr;
+  int32_t nr_words = (params->nr_blks + 31) / 32;
+  if (info->bitmap) pmm->free(info->bitmap);
+  info->bitmap = pmm->alloc(nr_words * sizeof(uint32_t));
+  naivefs_mark_blks(fs, 0, params->data_head, true);
+  if (params->nr_blks % 32) {
+    info->bitmap[nr_words - 1] |= ~0u << (params->nr_blks % 32);
+    pcache_write(dev, naivefs_blk_offset(fs, params->bitmap) + (nr_words - 1) * sizeof(uint32_t),
+        &info->bitmap[nr_words - 1], sizeof(uint32_t));
+  }
+  naivefs_put_params(fs, params);
+
+  naivefs_dinode_t d = {};
+  d.type = TYPE_MNTP;
+  d.flags = P_RD | P_WR;
+  naivefs_put_dinode(fs, 0, &d);
+  pcache_sync(dev); // nothing is logged yet, so the new layout goes home now
+}
+
+int naivefs_mkfs(device_t *dev, int32_t blk_size) {
+  if (blk_size < NAIVEFS_MIN_BLK || blk_size > NAIVEFS_MAX_BLK) return E_BADFS;
+  if (blk_size & (blk_size - 1)) return E_BADFS;
+
+  naivefs_info_t info = {};
+  spinlock_init(&info.lock, "naivefs alloc lock");
+  filesystem_t fs = { .name = "mkfs", .dev = dev, .ptr = &info };
+  naivefs_format(&fs, dev, blk_size);
+  pmm->free(info.bitmap);
+  return 0;
+}
+
+typedef struct naivefs_legacy {
+  naivefs_entry_v0_t entry;
+  int32_t blk;
+  char *data;
+  size_t size;
+} naivefs_legacy_t;
+
+static naivefs_entry_v0_t naivefs_v0_entry(device_t *dev, naivefs_params_v0_t *old, int32_t blk) {
+  naivefs_entry_v0_t ret;
+  pcache_read(dev, old->data_head + blk * old->blk_size, (void *)&ret, sizeof(ret));
+  return ret;
+}
+
+static int32_t naivefs_v0_next(device_t *dev, naivefs_params_v0_t *old, int32_t blk) {
+  int32_t ret = 0;
+  pcache_read(dev, old->map_head + blk * sizeof(int32_t), (void *)&ret, sizeof(int32_t));
+  return ret;
+}
+
+static naivefs_legacy_t *naivefs_read_v0(device_t *dev, naivefs_params_v0_t *old, int *nr) {
+  // pulls the whole legacy tree into memory before the device is reformatted
+  *nr = 0;
+  for (int32_t blk = 1; blk; blk = naivefs_v0_next(dev, old, blk)) ++*nr;
+  naivefs_legacy_t *items = pmm->alloc(*nr * sizeof(naivefs_legacy_t));
+
+  int n = 0;
+  for (int32_t blk = 1; blk; blk = naivefs_v0_next(dev, old, blk)) {
+    naivefs_legacy_t *it = &items[n++];
+    it->entry = naivefs_v0_entry(dev, old, blk);
+    it->entry.path[sizeof(it->entry.path) - 1] = '\0';
+    it->blk = blk;
+    if (it->entry.type != TYPE_FILE) continue;
+
+    // legacy sizes end at the first NUL of the last block
+    size_t cap = old->blk_size;
+    it->data = pmm->alloc(cap + 1);
+    for (int32_t b = it->entry.head; b; b = naivefs_v0_next(dev, old, b)) {
+      naivefs_entry_v0_t ce = naivefs_v0_entry(dev, old, b);
+      size_t len = 0;
+      while (len < old->blk_size && ce.content[len]) ++len;
+      if (it->size + len > cap) {
+        char *data = pmm->alloc(cap * 2 + 1);
+        memcpy(data, it->data, it->size);
+        pmm->free(it->data);
+        it->data = data;
+        cap *= 2;
+      }
+      memcpy(it->data + it->size, ce.content, len);
+      it->size += len;
+      if (len < old->blk_size) break;
+    }
+  }
+  return items;
+}
+
+static void naivefs_v0_path(filesystem_t *fs, naivefs_legacy_t *it, char *path) {
+  size_t plen = strlen(fs->root->path);
+  if (fs->root->path[plen - 1] == '/') --plen;
+  snprintf(path, plen, "%s", fs->root->path);
+  strcat(path, it->entry.path);
+}
+
+static void naivefs_migrate_v0(filesystem_t *fs, naivefs_legacy_t *items, int nr) {
+  // recreates the legacy tree on the freshly formatted fs, parents first
+  char path[256];
+  int depth = 0;
+  for (int i = 0; i < nr; ++i) {
+    int dep = 0;
+    for (const char *p = items[i].entry.path; *p; ++p) dep += *p == '/';
+    if (dep > depth) depth = dep;
+  }
+  for (int dep = 1; dep <= depth; ++dep) {
+    for (int i = 0; i < nr; ++i) {
+      naivefs_legacy_t *it = &items[i];
+      if (it->entry.type != TYPE_DIRC && it->entry.type != TYPE_FILE) continue;
+      int d = 0;
+      for (const char *p = it->entry.path; *p; ++p) d += *p == '/';
+      if (d != dep) continue;
+
+      naivefs_v0_path(fs, it, path);
+      inode_t *ip = naivefs_create(fs, inode_search(fs->root, path), path,
+          it->entry.type, it->entry.flags, NULL);
+      if (ip && ip->type == TYPE_FILE) {
+        naivefs_begin(fs);
+        naivefs_do_write(fs, ip, it->data, it->size, 0);
+        naivefs_end(fs);
+      }
+    }
+  }
+  for (int i = 0; i < nr; ++i) {
+    // links refer to their target's entry block, dangling ones are dropped
+    naivefs_legacy_t *it = &items[i];
+    if (it->entry.type != TYPE_LINK) continue;
+    inode_t *target = NULL;
+    for (int j = 0; j < nr; ++j) {
+      if (items[j].blk != it->entry.head) continue;
+      naivefs_v0_path(fs, &items[j], path);
+      target = inode_search(fs->root, path);
+      if (strcmp(target->path, path)) target = NULL;
+    }
+    if (!target) continue;
+    naivefs_v0_path(fs, it, path);
+    naivefs_create(fs, inode_search(fs->root, path), path, TYPE_LINK, it->entry.flags, target);
+  }
+}
+
 void naivefs_init(filesystem_t *fs, const char *path, device_t *dev) {
   fs->dev = dev;
+  spinlock_init(&fs->lock, fs->name);
 
   if (!fs->root) {
     fs->root = pmm->alloc(sizeof(inode_t));
@@ -405,67 +1821,116 @@ void naivefs_init(filesystem_t *fs, const char *path, device_t *dev) {
     fs->root->fchild = NULL;
     fs->root->cousin = NULL;
     fs->root->ops = &naive_ops;
+    spinlock_init(&fs->root->lock, "naivefs inode lock");
   }
-  fs->root->ptr = pmm->alloc(sizeof(naivefs_params_t));
-  dev->ops->read(dev, 0, fs->root->ptr, sizeof(naivefs_params_t));
-
-  naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-  if (params->blk_size == 0) {
-    params->blk_size  = 0x00000020;
-    params->map_head  = 0x00000010;
-    params->data_head = 0x00002000;
-    params->min_free  = 0x00000000;
-    dev->ops->write(dev, 0, params, sizeof(naivefs_params_t));
-
-    naivefs_entry_t entry = {
-      .head = 0x00000000,
-      .type = (int16_t)TYPE_MNTP,
-      .flags = (int16_t)(P_RD | P_WR),
-    };
-    sprintf(entry.path, "/");
-    naivefs_add_entry(fs, &entry);
-  }
-
-  int32_t blk = 1;
-  while (blk) {
-    naivefs_entry_t entry = naivefs_get_entry(fs, blk);  
-    if (entry.type != TYPE_INVL) {
-      inode_t *ip = pmm->alloc(sizeof(inode_t));
-      ip->refcnt = 0;
-      ip->type = (int)entry.type;
-      ip->flags = (int)entry.flags;
-      ip->blk = entry.head;
-      if (ip->type == TYPE_LINK) {
-        naivefs_entry_t link_entry = naivefs_get_entry(fs, ip->blk);
-        inode_t *lp = inode_search(fs->root, link_entry.path);
-        if (strlen(lp->path) != strlen(link_entry.path)) continue;
-        ip->ptr = (void *)lp;
-      }
-      sprintf(ip->path, "%s", path);
-      if (path[strlen(path) - 1] == '/') {
-        ip->path[strlen(path) - 1] = '\0';
-      }
-      strcat(ip->path, entry.path);
-      ip->offset = 0;
-      ip->size = naivefs_get_file_size(fs, &entry);
-      ip->fs = fs;
-      ip->ops = pmm->alloc(sizeof(inodeops_t));
-      memcpy(ip->ops, &naive_ops, sizeof(inodeops_t));
-
-      inode_t *pp = inode_search(fs->root, ip->path);
-      ip->parent = pp;
-      ip->fchild = NULL;
-      ip->cousin = NULL;
-      inode_insert(pp, ip);
+  fs->root->blk = 0;
+  naivefs_info_t *info = pmm->alloc(sizeof(naivefs_info_t));
+  spinlock_init(&info->lock, "naivefs alloc lock");
+  spinlock_init(&info->journal.lock, "naivefs journal lock");
+  fs->ptr = info;
+  pcache_read(dev, 0, &info->params, sizeof(naivefs_params_t));
+
+  naivefs_params_t *params = naivefs_params(fs);
+  naivefs_legacy_t *legacy = NULL;
+  int nr_legacy = 0;
+  if (params->magic != NAIVEFS_MAGIC) {
+    naivefs_params_v0_t old = *(naivefs_params_v0_t *)params;
+    if (old.blk_size == sizeof(naivefs_entry_v0_t)) {
+      legacy = naivefs_read_v0(dev, &old, &nr_legacy);
+    }
+    naivefs_format(fs, dev, NAIVEFS_BLK_SIZE);
+  }
+  Assert(params->version == NAIVEFS_VERSION, "naivefs: unsupported version %d", params->version);
+  Assert(params->blk_size >= NAIVEFS_MIN_BLK && params->blk_size <= NAIVEFS_MAX_BLK
+      && !(params->blk_size & (params->blk_size - 1)), "naivefs: bad block size %d", params->blk_size);
+  if (naivefs_replay(fs)) {
+    pcache_read(dev, 0, &info->params, sizeof(naivefs_params_t));
+  }
+  if (!info->bitmap) {
+    int32_t nr_words = (params->nr_blks + 31) / 32;
+    info->bitmap = pmm->alloc(nr_words * sizeof(uint32_t));
+    pcache_read(dev, naivefs_blk_offset(fs, params->bitmap), info->bitmap, nr_words * sizeof(uint32_t));
+  }
+
+  // only the root directory is loaded, the rest comes in on lookup
+  info->lru.next = info->lru.prev = &info->lru;
+  naivefs_dinode_t d;
+  naivefs_get_dinode(fs, 0, &d);
+  fs->root->ptr = naivefs_emap_load(fs, &d);
+  fs->root->size = d.size;
+
+  if (legacy) {
+    naivefs_migrate_v0(fs, legacy, nr_legacy);
+    for (int i = 0; i < nr_legacy; ++i) {
+      if (legacy[i].data) pmm->free(legacy[i].data);
     }
-    blk = naivefs_get_next_blk(fs, blk);
+    pmm->free(legacy);
   }
 }
 
+int naivefs_bench(int32_t blk_size, size_t nbytes, uint32_t *wtime, uint32_t *rtime) {
+  // formats a scratch ramdisk, then times a sequential write and read back
+  extern devops_t rd_ops;
+  size_t disk = nbytes + (1 << 20);
+  rd_t *rd = pmm->alloc(sizeof(rd_t));
+  rd->start = pmm->alloc(disk);
+  rd->end = rd->start + disk;
+  device_t *dev = pmm->alloc(sizeof(device_t));
+  dev->name = "fsbench";
+  dev->ptr = rd;
+  dev->ops = &rd_ops;
+
+  int ret = naivefs_mkfs(dev, blk_size);
+  if (ret == 0) {
+    filesystem_t *fs = pmm->alloc(sizeof(filesystem_t));
+    fs->name = "benchfs";
+    fs->ops = &naivefs_ops;
+    naivefs_init(fs, "/bench", dev);
+    spinlock_acquire(&fs->lock);
+    inode_t *ip = naivefs_lookup(fs, "/bench/data", O_RDWR | O_CREAT);
+    spinlock_release(&fs->lock);
+
+    file_t file = { .refcnt = 1, .inode = ip };
+    char *chunk = pmm->alloc(NAIVEFS_BENCH_CHUNK);
+    memset(chunk, 'x', NAIVEFS_BENCH_CHUNK);
+    uint32_t start = uptime();
+    for (size_t off = 0; off < nbytes; off += NAIVEFS_BENCH_CHUNK) {
+      naive_pwrite(fs, &file, chunk, NAIVEFS_BENCH_CHUNK, off);
+    }
+    pcache_sync(dev);
+    *wtime = uptime() - start;
+    start = uptime();
+    for (size_t off = 0; off < nbytes; off += NAIVEFS_BENCH_CHUNK) {
+      naive_pread(fs, &file, chunk, NAIVEFS_BENCH_CHUNK, off);
+    }
+    *rtime = uptime() - start;
+
+    pmm->free(chunk);
+    inode_remove(fs->root, ip);
+    naivefs_icache_del(fs, ip);
+    naivefs_free_inode(ip);
+    dcache_purge(fs->root);
+    naivefs_emap_free(fs->root->ptr);
+    naivefs_info_t *info = fs->ptr;
+    if (info->journal.recs) pmm->free(info->journal.recs);
+    pmm->free(info->bitmap);
+    pmm->free(info);
+    pmm->free(fs->root);
+    pmm->free(fs);
+  }
+  pcache_invalidate(dev);
+  pmm->free(rd->start);
+  pmm->free(rd);
+  pmm->free(dev);
+  return ret;
+}
+
 inode_t *naivefs_lookup(filesystem_t *fs, const char *path, int flags) {
+  naivefs_icache_shrink(fs);
   inode_t *ip = inode_search(fs->root, path);
   if (strlen(ip->path) == strlen(path)) {
     if ((flags & ip->flags) == (flags & ~O_CREAT)) {
+      naivefs_icache_touch(fs, ip);
       return ip;
     } else {
       return NULL;
@@ -474,41 +1939,10 @@ inode_t *naivefs_lookup(filesystem_t *fs, const char *path, int flags) {
     if (flags & O_CREAT) {
       VFSLog("not found. create a new one!");
       size_t len = strlen(path);
-      if (len - strlen(fs->root->path) >= 23) return NULL; // naivefs limitation
       for (size_t i = strlen(ip->path) + 1; i < len; ++i) {
         if (path[i] == '/') return NULL;
       }
-
-      naivefs_params_t *params = (naivefs_params_t *)fs->root->ptr;
-      naivefs_entry_t entry = {
-        .head = params->min_free,
-        .type = TYPE_FILE,
-        .flags = P_RD | P_WR,
-      };
-      sprintf(entry.path, "%s", path + strlen(fs->root->path));
-      ++params->min_free;
-      VFSLog("data will be in blk %d", entry.head);
-      int32_t blk = naivefs_add_entry(fs, &entry);
-      VFSLog("entry is put in blk %d", blk);
-
-      inode_t *pp = ip;
-      ip = pmm->alloc(sizeof(inode_t));
-      ip->refcnt = 0;
-      ip->type = TYPE_FILE;
-      ip->flags = P_RD | P_WR;
-      ip->blk = blk;
-      sprintf(ip->path, "%s", path);
-      ip->offset = 0;
-      ip->size = 0;
-      ip->fs = fs;
-      ip->ops = pmm->alloc(sizeof(inodeops_t));
-      memcpy(ip->ops, &naive_ops, sizeof(inodeops_t));
-
-      ip->parent = pp;
-      ip->fchild = NULL;
-      ip->cousin = NULL;
-      inode_insert(pp, ip);
-      return ip;
+      return naivefs_create(fs, ip, path, TYPE_FILE, P_RD | P_WR, NULL);
     } else {
       return NULL;
     }
@@ -516,14 +1950,12 @@ inode_t *naivefs_lookup(filesystem_t *fs, const char *path, int flags) {
 }
 
 int naivefs_close(inode_t *inode) {
-  if (inode->type == TYPE_FILE && inode->size <= 0) {
-    int32_t blk = inode->blk;
-    naivefs_entry_t entry = naivefs_get_entry(inode->fs, blk);
-    entry.type = TYPE_INVL;
-    naivefs_put_entry(inode->fs, blk, &entry);
-    inode_remove(inode->parent, inode);
-    pmm->free(inode->ops);
-    pmm->free(inode);
+  // caller holds fs->lock
+  if (inode->refcnt > 0) return 0;
+  if (naivefs_orphan(inode)) {
+    naivefs_reap(inode->fs, inode);
+  } else if (inode->type == TYPE_FILE && inode->size <= 0) {
+    naivefs_destroy(inode->fs, inode);
   }
   return 0;
 }
@@ -25,94 +25,205 @@ void mount_procfs() {
   VFSCLog(BG_YELLOW, "/proc initialiezd.");
 }
 
+/**
+ * Every procfs file is generated by a seq_ops iterator, one record at a
+ * time. An open file keeps the last shown record, so sequential reads
+ * continue from it and only format what is consumed; seeking backwards
+ * starts over from the first record.
+ */
+
+#define SEQ_BUF_SIZE 256 // longest record
+
+typedef struct procfs_entry procfs_entry_t;
+struct seq_ops {
+  void *(*start)(procfs_entry_t *pe);          // first record, NULL if none
+  void *(*next)(procfs_entry_t *pe, void *rec); // record after rec, NULL at the end
+  int (*show)(procfs_entry_t *pe, void *rec, char *buf, size_t size);
+};
+
+struct procfs_entry {
+  const struct seq_ops *ops;
+  task_t *task; // NULL for system-wide files
+};
+
+struct seq_file {
+  void *rec;     // record in buf
+  bool started;
+  off_t pos;     // file offset of buf[0]
+  size_t len;
+  char buf[SEQ_BUF_SIZE];
+};
+
+static inline void seq_rewind(struct seq_file *seq) {
+  seq->rec = NULL;
+  seq->started = false;
+  seq->pos = 0;
+  seq->len = 0;
+}
+
 int procops_open(filesystem_t *fs, file_t *file, int flags) {
   if ((flags & file->inode->flags) != (flags & ~O_CREAT)) return E_BADPR;
-  file->inode->offset = 0;
+  file->offset = 0;
+  struct seq_file *seq = pmm->alloc(sizeof(struct seq_file));
+  seq_rewind(seq);
+  file->ptr = seq;
   return 0;
 }
 
 int procops_close(filesystem_t *fs, file_t *file) {
-  file->inode->offset = 0;
+  file->offset = 0;
+  pmm->free(file->ptr);
+  file->ptr = NULL;
   return fs->ops->close(file->inode);
 }
 
-inline ssize_t read_proc(task_t *tp, char *buf, size_t size) {
+ssize_t procops_read(filesystem_t *fs, file_t *file, char *buf, size_t size) {
+  procfs_entry_t *pe = file->inode->ptr;
+  struct seq_file *seq = file->ptr;
+  if (file->offset < seq->pos) seq_rewind(seq);
+
+  ssize_t nread = 0;
+  while (nread < size) {
+    off_t at = file->offset + nread;
+    if (at < seq->pos + seq->len) {
+      size_t len = seq->pos + seq->len - at;
+      if (len > size - nread) len = size - nread;
+      memcpy(buf + nread, seq->buf + (at - seq->pos), len);
+      nread += len;
+      continue;
+    }
+    // buf is used up, format the next record
+    if (seq->started && !seq->rec) break;
+    seq->rec = seq->started ? pe->ops->next(pe, seq->rec) : pe->ops->start(pe);
+    seq->started = true;
+    seq->pos += seq->len;
+    seq->len = 0;
+    if (!seq->rec) break;
+    int len = pe->ops->show(pe, seq->rec, seq->buf, sizeof(seq->buf));
+    seq->len = len < 0 ? 0 : len < sizeof(seq->buf) ? len : sizeof(seq->buf) - 1;
+  }
+  file->offset += nread;
+  return nread;
+}
+
+off_t procops_lseek(filesystem_t *fs, file_t *file, off_t offset, int whence) {
+  // the size is unknown until generated, so there is no SEEK_END
+  switch (whence) {
+    case SEEK_SET:
+      file->offset = offset;
+      break;
+    case SEEK_CUR:
+      file->offset += offset;
+      break;
+    default:
+      return E_BADTP;
+  }
+  return file->offset;
+}
+
+static char *u64_str(char *buf, uint64_t v) {
+  // buf holds 21 chars, the digits end at its end
+  char *p = buf + 20;
+  *p = '\0';
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  return p;
+}
+
+// files of a single record
+
+static void *single_start(procfs_entry_t *pe) {
+  return pe->task ? (void *)pe->task : (void *)pe;
+}
+
+static void *single_next(procfs_entry_t *pe, void *rec) {
+  return NULL;
+}
+
+static void *self_start(procfs_entry_t *pe) {
+  return get_current_task();
+}
+
+static int show_proc(procfs_entry_t *pe, void *rec, char *buf, size_t size) {
+  task_t *tp = rec;
   return snprintf(buf, size, "Process %d:\n - Name: %s\n - State: %s\n",
       tp->pid, tp->name, task_states_human[tp->state]);
 }
-ssize_t procops_read(filesystem_t *fs, file_t *file, char *buf, size_t size) {
-  char *path = file->inode->path;
-  if (!strcmp(path, "/proc/self")) {
-    task_t *cur = get_current_task();
-    return read_proc(cur, buf, size); 
-  } else if (!strcmp(path, "/proc/cpuinfo")) {
-    return snprintf(buf, size, "CPU info:\n - Cores: %d\n - Model: i%d-996X\n", _ncpu(), _ncpu() + 3);
-  } else if (!strcmp(path, "/proc/meminfo")) {
-    return snprintf(buf, size, "MEM info:\n - Start: 0x%p\n -   End: 0x%p\n", _heap.start, _heap.end);
-  } else {
-    return read_proc(file->inode->ptr, buf, size);
-  }
+
+static int show_stat(procfs_entry_t *pe, void *rec, char *buf, size_t size) {
+  // pid (name) state runtime sleeptime nvcsw nivcsw last_cpu
+  task_t *tp = rec;
+  char run[21], sleep[21];
+  return snprintf(buf, size, "%d (%s) %s %s %s %d %d %d\n",
+      tp->pid, tp->name, task_states_human[tp->state],
+      u64_str(run, tp->runtime), u64_str(sleep, tp->sleeptime),
+      tp->nvcsw, tp->nivcsw, tp->last_cpu);
 }
 
-inline void procfs_self() {
-  inode_t *ip = pmm->alloc(sizeof(inode_t));
-  ip->type = TYPE_PROX;
-  ip->flags = P_RD;
-  ip->ptr = NULL;
-  sprintf(ip->path, "/proc/self");
-  ip->fs = &procfs;
-  ip->ops = pmm->alloc(sizeof(inodeops_t));
-  memcpy(ip->ops, &error_ops, sizeof(inodeops_t));
-  ip->ops->open = procops_open;
-  ip->ops->close = procops_close;
-  ip->ops->read = procops_read;
+static int show_cpuinfo(procfs_entry_t *pe, void *rec, char *buf, size_t size) {
+  return snprintf(buf, size, "CPU info:\n - Cores: %d\n - Model: i%d-996X\n", _ncpu(), _ncpu() + 3);
+}
 
-  ip->parent = ip->fs->root;
-  ip->fchild = NULL;
-  ip->cousin = NULL;
-  inode_insert(ip->parent, ip);
+static int show_meminfo(procfs_entry_t *pe, void *rec, char *buf, size_t size) {
+  return snprintf(buf, size, "MEM info:\n - Start: 0x%p\n -   End: 0x%p\n", _heap.start, _heap.end);
 }
 
-inline void procfs_cpuinfo() {
-  inode_t *ip = pmm->alloc(sizeof(inode_t));
-  ip->type = TYPE_PROX;
-  ip->flags = P_RD;
-  ip->ptr = NULL;
-  sprintf(ip->path, "/proc/cpuinfo");
-  ip->fs = &procfs;
-  ip->ops = pmm->alloc(sizeof(inodeops_t));
-  memcpy(ip->ops, &error_ops, sizeof(inodeops_t));
-  ip->ops->open = procops_open;
-  ip->ops->close = procops_close;
-  ip->ops->read = procops_read;
+// one record per CPU
 
-  ip->parent = ip->fs->root;
-  ip->fchild = NULL;
-  ip->cousin = NULL;
-  inode_insert(ip->parent, ip);
+static void *cpu_start(procfs_entry_t *pe) {
+  return &cpu_stats[0];
+}
+
+static void *cpu_next(procfs_entry_t *pe, void *rec) {
+  struct cpu_stat *cs = (struct cpu_stat *)rec + 1;
+  return cs < &cpu_stats[_ncpu()] ? cs : NULL;
 }
 
-inline void procfs_meminfo() {
+static int show_cpu_stat(procfs_entry_t *pe, void *rec, char *buf, size_t size) {
+  // cpu<N> busy idle trap, in TSC cycles
+  struct cpu_stat *cs = rec;
+  char busy[21], idle[21], trap[21];
+  return snprintf(buf, size, "cpu%d %s %s %s\n", (int)(cs - cpu_stats),
+      u64_str(busy, cs->busy), u64_str(idle, cs->idle), u64_str(trap, cs->trap));
+}
+
+static const struct seq_ops self_ops    = { self_start,   single_next, show_proc     };
+static const struct seq_ops cpuinfo_ops = { single_start, single_next, show_cpuinfo  };
+static const struct seq_ops meminfo_ops = { single_start, single_next, show_meminfo  };
+static const struct seq_ops cpustat_ops = { cpu_start,    cpu_next,    show_cpu_stat };
+static const struct seq_ops proc_ops    = { single_start, single_next, show_proc     };
+static const struct seq_ops stat_ops    = { single_start, single_next, show_stat     };
+
+static inode_t *procfs_add(inode_t *parent, int type, const struct seq_ops *ops, task_t *task, const char *path) {
+  procfs_entry_t *pe = pmm->alloc(sizeof(procfs_entry_t));
+  pe->ops = ops;
+  pe->task = task;
+
   inode_t *ip = pmm->alloc(sizeof(inode_t));
-  ip->type = TYPE_PROX;
+  ip->type = type;
   ip->flags = P_RD;
-  ip->ptr = NULL;
-  sprintf(ip->path, "/proc/meminfo");
-  ip->fs = &procfs;
+  ip->ptr = pe;
+  sprintf(ip->path, "%s", path);
+  ip->fs = parent->fs;
   ip->ops = pmm->alloc(sizeof(inodeops_t));
   memcpy(ip->ops, &error_ops, sizeof(inodeops_t));
   ip->ops->open = procops_open;
   ip->ops->close = procops_close;
   ip->ops->read = procops_read;
+  ip->ops->lseek = procops_lseek;
 
-  ip->parent = ip->fs->root;
+  ip->parent = parent;
   ip->fchild = NULL;
   ip->cousin = NULL;
   inode_insert(ip->parent, ip);
+  return ip;
 }
 
 void procfs_init(filesystem_t *fs, const char *path, device_t *dev) {
   if (!fs->root) {
+    spinlock_init(&fs->lock, fs->name);
     fs->root = pmm->alloc(sizeof(inode_t));
     fs->root->type = TYPE_MNTP;
     fs->root->flags = P_RD;
@@ -126,11 +237,18 @@ void procfs_init(filesystem_t *fs, const char *path, device_t *dev) {
     memcpy(fs->root->ops, &error_ops, sizeof(inodeops_t));
   }
 
+  char name[128];
+  spinlock_acquire(&fs->lock);
   if (fs->root->fchild == NULL) {
-    // first init, add /self, /cpuinfo, /meminfo
-    procfs_self();
-    procfs_cpuinfo();
-    procfs_meminfo();
+    // first init, add /self, /cpuinfo, /meminfo, /stat
+    sprintf(name, "%s/self", path);
+    procfs_add(fs->root, TYPE_PROX, &self_ops, NULL, name);
+    sprintf(name, "%s/cpuinfo", path);
+    procfs_add(fs->root, TYPE_PROX, &cpuinfo_ops, NULL, name);
+    sprintf(name, "%s/meminfo", path);
+    procfs_add(fs->root, TYPE_PROX, &meminfo_ops, NULL, name);
+    sprintf(name, "%s/stat", path);
+    procfs_add(fs->root, TYPE_PROX, &cpustat_ops, NULL, name);
   }
 
   // remove all procs first
@@ -149,23 +267,12 @@ void procfs_init(filesystem_t *fs, const char *path, device_t *dev) {
   // add all procs again
   for (task_t *tp = root_task.next; tp != NULL; tp = tp->next) {
     VFSCLog(BG_YELLOW, "add inode of %s/%d", path, tp->pid);
-    inode_t *ip = pmm->alloc(sizeof(inode_t));
-    ip->type = TYPE_PROC;
-    ip->flags = P_RD;
-    ip->ptr = (void *)tp;
-    sprintf(ip->path, "%s/%d", path, tp->pid);
-    ip->fs = fs;
-    ip->ops = pmm->alloc(sizeof(inodeops_t));
-    memcpy(ip->ops, &error_ops, sizeof(inodeops_t));
-    ip->ops->open = procops_open;
-    ip->ops->close = procops_close;
-    ip->ops->read = procops_read;
-
-    ip->parent = fs->root;
-    ip->fchild = NULL;
-    ip->cousin = NULL;
-    inode_insert(ip->parent, ip);
+    sprintf(name, "%s/%d", path, tp->pid);
+    inode_t *ip = procfs_add(fs->root, TYPE_PROC, &proc_ops, tp, name);
+    sprintf(name, "%s/stat", ip->path);
+    procfs_add(ip, TYPE_PROX, &stat_ops, tp, name);
   }
+  spinlock_release(&fs->lock);
 }
 
 inode_t *procfs_lookup(filesystem_t *fs, const char *path, int flags) {
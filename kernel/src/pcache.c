@@ -0,0 +1,242 @@
+#include <common.h>
+#include <pcache.h>
+
+static struct spinlock pcache_lock = {
+  "pcache lock", 0, -1
+};
+static struct page pages[NR_PCACHE_PAGES] = {};
+static char page_data[NR_PCACHE_PAGES][PCACHE_PAGE_SIZE] __attribute__((aligned(PCACHE_PAGE_SIZE)));
+static struct page *buckets[NR_PCACHE_BUCKETS] = {};
+static struct page lru = {};
+
+#define NR_SYNC_QUEUES 8
+
+static inline uint32_t pcache_hash(device_t *dev, off_t offset) {
+  return ((uint32_t)(uintptr_t)dev / sizeof(device_t) + (uint32_t)offset / PCACHE_PAGE_SIZE) % NR_PCACHE_BUCKETS;
+}
+
+static inline void lru_unlink(struct page *pg) {
+  pg->prev->next = pg->next;
+  pg->next->prev = pg->prev;
+}
+
+static inline void lru_push_front(struct page *pg) {
+  pg->next = lru.next;
+  pg->prev = &lru;
+  lru.next->prev = pg;
+  lru.next = pg;
+}
+
+static void hash_remove(struct page *pg) {
+  struct page **pp = &buckets[pcache_hash(pg->dev, pg->offset)];
+  while (*pp && *pp != pg) pp = &(*pp)->hnext;
+  if (*pp) *pp = pg->hnext;
+  pg->hnext = NULL;
+}
+
+static void submit(struct page *pg, int op, size_t lo, size_t hi) {
+  // lo and hi are sector-aligned; sectors past the device end are left out
+  blkdev_t *bdev = pg->dev->blk;
+  uint32_t sector = (pg->offset + lo) / BLK_SECTOR_SIZE;
+  uint32_t nr = (hi - lo) / BLK_SECTOR_SIZE;
+  pg->bio.flags = BIO_DONE;
+  if (sector >= bdev->nr_sectors) return;
+  if (nr > bdev->nr_sectors - sector) nr = bdev->nr_sectors - sector;
+  pg->bio = (struct bio) {
+    .op = op,
+    .sector = sector,
+    .nr_sectors = nr,
+    .buf = pg->data + lo,
+    .priv = pg,
+  };
+  blk_submit(bdev, &pg->bio);
+}
+
+static void writeback(struct page *pg) {
+  // only the dirty range goes back, the page may extend past the device end;
+  // the bio completes once the device's queue runs
+  if (!(pg->flags & PG_DIRTY)) return;
+  if (pg->dev->blk) {
+    submit(pg, BIO_WRITE, pg->dirty_lo / BLK_SECTOR_SIZE * BLK_SECTOR_SIZE,
+        (pg->dirty_hi + BLK_SECTOR_SIZE - 1) / BLK_SECTOR_SIZE * BLK_SECTOR_SIZE);
+  } else {
+    pg->dev->ops->write(pg->dev, pg->offset + pg->dirty_lo,
+        pg->data + pg->dirty_lo, pg->dirty_hi - pg->dirty_lo);
+  }
+  pg->flags &= ~PG_DIRTY;
+  pg->dirty_lo = pg->dirty_hi = 0;
+}
+
+static void fill(struct page *pg) {
+  memset(pg->data, 0, PCACHE_PAGE_SIZE);
+  if (pg->dev->blk) {
+    submit(pg, BIO_READ, 0, PCACHE_PAGE_SIZE);
+    blk_wait(pg->dev->blk, &pg->bio);
+  } else {
+    pg->dev->ops->read(pg->dev, pg->offset, pg->data, PCACHE_PAGE_SIZE);
+  }
+}
+
+void pcache_init() {
+  lru.next = lru.prev = &lru;
+  for (int i = 0; i < NR_PCACHE_PAGES; ++i) {
+    pages[i].data = page_data[i];
+    lru_push_front(&pages[i]);
+  }
+}
+
+static struct page *pcache_find(device_t *dev, off_t offset) {
+  for (struct page *pg = buckets[pcache_hash(dev, offset)]; pg != NULL; pg = pg->hnext) {
+    if (pg->dev == dev && pg->offset == offset) return pg;
+  }
+  return NULL;
+}
+
+static struct page *pcache_lookup(device_t *dev, off_t offset) {
+  // caller holds pcache_lock, offset is page-aligned
+  struct page *pg = pcache_find(dev, offset);
+  if (!pg) {
+    for (pg = lru.prev; pg != &lru; pg = pg->prev) {
+      if (pg->refcnt == 0) break;
+    }
+    Assert(pg != &lru, "all pages in the page cache are pinned");
+    if (pg->flags & PG_VALID) {
+      writeback(pg);
+      if (pg->dev->blk) blk_wait(pg->dev->blk, &pg->bio);
+      hash_remove(pg);
+    }
+    pg->dev = dev;
+    pg->offset = offset;
+    fill(pg);
+    pg->flags = PG_VALID;
+    uint32_t h = pcache_hash(dev, offset);
+    pg->hnext = buckets[h];
+    buckets[h] = pg;
+  }
+  lru_unlink(pg);
+  lru_push_front(pg);
+  return pg;
+}
+
+struct page *pcache_get(device_t *dev, off_t offset) {
+  spinlock_acquire(&pcache_lock);
+  struct page *pg = pcache_lookup(dev, offset - offset % PCACHE_PAGE_SIZE);
+  ++pg->refcnt;
+  spinlock_release(&pcache_lock);
+  return pg;
+}
+
+void pcache_put(struct page *pg) {
+  spinlock_acquire(&pcache_lock);
+  Assert(pg->refcnt > 0, "putting an unpinned page");
+  --pg->refcnt;
+  spinlock_release(&pcache_lock);
+}
+
+static inline void mark_dirty(struct page *pg, size_t lo, size_t hi) {
+  if (pg->flags & PG_DIRTY) {
+    if (lo < pg->dirty_lo) pg->dirty_lo = lo;
+    if (hi > pg->dirty_hi) pg->dirty_hi = hi;
+  } else {
+    pg->flags |= PG_DIRTY;
+    pg->dirty_lo = lo;
+    pg->dirty_hi = hi;
+  }
+}
+
+void pcache_dirty(struct page *pg, size_t lo, size_t hi) {
+  spinlock_acquire(&pcache_lock);
+  mark_dirty(pg, lo, hi);
+  spinlock_release(&pcache_lock);
+}
+
+ssize_t pcache_read(device_t *dev, off_t offset, void *buf, size_t count) {
+  size_t done = 0;
+  spinlock_acquire(&pcache_lock);
+  while (done < count) {
+    size_t in = (offset + done) % PCACHE_PAGE_SIZE;
+    size_t len = PCACHE_PAGE_SIZE - in;
+    if (len > count - done) len = count - done;
+    struct page *pg = pcache_lookup(dev, offset + done - in);
+    memcpy((char *)buf + done, pg->data + in, len);
+    done += len;
+  }
+  spinlock_release(&pcache_lock);
+  return done;
+}
+
+ssize_t pcache_write(device_t *dev, off_t offset, const void *buf, size_t count) {
+  size_t done = 0;
+  spinlock_acquire(&pcache_lock);
+  while (done < count) {
+    size_t in = (offset + done) % PCACHE_PAGE_SIZE;
+    size_t len = PCACHE_PAGE_SIZE - in;
+    if (len > count - done) len = count - done;
+    struct page *pg = pcache_lookup(dev, offset + done - in);
+    memcpy(pg->data + in, (const char *)buf + done, len);
+    mark_dirty(pg, in, in + len);
+    done += len;
+  }
+  spinlock_release(&pcache_lock);
+  return done;
+}
+
+void pcache_invalidate(device_t *dev) {
+  // drops the device's pages without writing them back
+  spinlock_acquire(&pcache_lock);
+  for (int i = 0; i < NR_PCACHE_PAGES; ++i) {
+    if ((pages[i].flags & PG_VALID) && pages[i].dev == dev) {
+      Assert(pages[i].refcnt == 0, "invalidating a pinned page");
+      hash_remove(&pages[i]);
+      pages[i].flags = 0;
+      pages[i].dev = NULL;
+      lru_unlink(&pages[i]);
+      pages[i].prev = lru.prev;
+      pages[i].next = &lru;
+      lru.prev->next = &pages[i];
+      lru.prev = &pages[i];
+    }
+  }
+  spinlock_release(&pcache_lock);
+}
+
+void pcache_flush(device_t *dev, off_t offset, size_t count) {
+  // writes back the cached pages over [offset, offset + count), so the
+  // device itself holds the current bytes; pinned pages are left to
+  // whoever pins them, a journal may not let them go home yet
+  spinlock_acquire(&pcache_lock);
+  if (dev->blk) blk_plug(dev->blk);
+  for (off_t pos = offset - offset % PCACHE_PAGE_SIZE; pos < offset + count; pos += PCACHE_PAGE_SIZE) {
+    struct page *pg = pcache_find(dev, pos);
+    if (pg && pg->refcnt == 0) writeback(pg);
+  }
+  if (dev->blk) blk_unplug(dev->blk);
+  spinlock_release(&pcache_lock);
+}
+
+void pcache_sync(device_t *dev) {
+  // queues are plugged for the whole pass so adjacent dirty pages reach the
+  // driver as merged requests
+  blkdev_t *plugged[NR_SYNC_QUEUES];
+  int nr_plugged = 0;
+  spinlock_acquire(&pcache_lock);
+  for (int i = 0; i < NR_PCACHE_PAGES; ++i) {
+    struct page *pg = &pages[i];
+    if (!(pg->flags & PG_VALID) || !(pg->flags & PG_DIRTY)) continue;
+    if (dev != NULL && pg->dev != dev) continue;
+    blkdev_t *bdev = pg->dev->blk;
+    if (bdev) {
+      int j = 0;
+      while (j < nr_plugged && plugged[j] != bdev) ++j;
+      if (j == nr_plugged && nr_plugged < NR_SYNC_QUEUES) {
+        blk_plug(bdev);
+        plugged[nr_plugged++] = bdev;
+      }
+    }
+    writeback(pg);
+  }
+  for (int j = 0; j < nr_plugged; ++j) {
+    blk_unplug(plugged[j]);
+  }
+  spinlock_release(&pcache_lock);
+}
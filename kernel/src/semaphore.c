@@ -29,7 +29,9 @@ void semaphore_wait(struct semaphore *sem) {
     cur->alarm = sem;
     spinlock_release(&os_trap_lock);
 
+    uint64_t start = rdtsc();
     _yield();
+    cur->sleeptime += rdtsc() - start;
     spinlock_acquire(&sem->lock);
   }
   __sync_synchronize();
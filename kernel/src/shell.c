@@ -18,6 +18,8 @@ const cmd_t cmd_list[] = {
   { "mkdir",  mkdir  },
   { "rmdir",  rmdir  },
   { "rm"   ,  rm     },
+  { "fsbench", fsbench },
+  { "sync",   sync   },
 };
 const int NR_CMD = sizeof(cmd_list) / sizeof(cmd_t);
 
@@ -27,6 +29,8 @@ void shell_task(void *arg) {
   char pwd[512] = "";
   char cmd[512] = "";
   char ret[512] = "";
+  char input[512] = ""; // read ahead, may hold several lines
+  int pending = 0;
 
   sprintf(buf, "/dev/tty%d", tty_id);
   int stdin = vfs->open(buf, O_RDONLY);
@@ -42,8 +46,20 @@ void shell_task(void *arg) {
     sprintf(buf, "(tty%d) %s\n -> ", tty_id, pwd);
     vfs->write(stdout, buf, strlen(buf));
 
-    ssize_t nread = vfs->read(stdin, cmd, sizeof(cmd));
-    cmd[nread - 1] = '\0';
+    // one line at a time out of whatever the tty handed over
+    int len = 0;
+    while (true) {
+      while (len < pending && input[len] != '\n') ++len;
+      if (len < pending || pending == sizeof(input)) break;
+      ssize_t nread = vfs->read(stdin, input + pending, sizeof(input) - pending);
+      if (nread > 0) pending += nread;
+    }
+    int used = (len < pending) ? len + 1 : len;
+    if (len == sizeof(cmd)) --len;
+    memcpy(cmd, input, len);
+    cmd[len] = '\0';
+    memmove(input, input + used, pending - used);
+    pending -= used;
     char *arg = cmd;
     while (*arg == ' ') ++arg;
     memset(ret, 0, sizeof(ret));
@@ -58,8 +74,11 @@ void shell_task(void *arg) {
       }
     }
     if (!succ) sprintf(ret, "Invalid command.\n");
-    vfs->write(stdout, ret, strlen(ret));
-    vfs->write(stdout, "\n", 1);
+    struct iovec iov[] = {
+      { ret, strlen(ret) },
+      { "\n", 1 },
+    };
+    vfs->writev(stdout, iov, 2);
   }
   Panic("shell cannot exit.");
 }
@@ -150,12 +169,15 @@ FUNC(cd) {
     if (vfs->access(dir, O_RDONLY)) {
       sprintf(ret, "Precheck failed: cannot access %s.\n");
     } else {
-      inode_t *ip = inode_search(root, dir);
-      if (ip->type == TYPE_MNTP || ip->type == TYPE_DIRC) {
+      filesystem_t *fs = find_fs(dir);
+      spinlock_acquire(&fs->lock);
+      int type = inode_search(fs->root, dir)->type;
+      spinlock_release(&fs->lock);
+      if (type == TYPE_MNTP || type == TYPE_DIRC) {
         strcpy(pwd, dir);
         sprintf(ret, "Directory changed to %s.\n", dir);
       } else {
-        sprintf(ret, "Invalid inode type of %s: %s.\n", dir, inode_types_human[ip->type]);
+        sprintf(ret, "Invalid inode type of %s: %s.\n", dir, inode_types_human[type]);
       }
     }
   }
@@ -176,7 +198,16 @@ FUNC(cat) {
           " %d: file has wrong privilege.\n",
           fd, E_BADFS, E_NOENT, E_BADTP, E_BADPR);
     } else {
-      vfs->read(fd, ret, 512);
+      // files that can be mapped are copied once, straight from the disk
+      const void *page;
+      size_t nread = 0;
+      ssize_t len;
+      while (nread < 511 && (len = vfs->get_page(fd, nread, &page)) > 0) {
+        if (len > 511 - nread) len = 511 - nread;
+        memcpy(ret + nread, page, len);
+        nread += len;
+      }
+      if (nread == 0) vfs->read(fd, ret, 511);
       vfs->close(fd);
     }
   }
@@ -208,8 +239,11 @@ FUNC(write) {
           " %d: file has wrong privilege.\n",
           fd, E_BADFS, E_NOENT, E_BADTP, E_BADPR);
     } else {
-      ssize_t nwrite = vfs->write(fd, (void *)arg2, strlen(arg2));
-      vfs->write(fd, "\n", 1);
+      struct iovec iov[] = {
+        { (void *)arg2, strlen(arg2) },
+        { "\n", 1 },
+      };
+      ssize_t nwrite = vfs->writev(fd, iov, 2);
       vfs->close(fd);
       sprintf(ret, "Writed %d bytes successfully.\n", nwrite);
     }
@@ -243,8 +277,11 @@ FUNC(append) {
           fd, E_BADFS, E_NOENT, E_BADTP, E_BADPR);
     } else {
       vfs->lseek(fd, 0, SEEK_END);
-      ssize_t nwrite = vfs->write(fd, (void *)arg2, strlen(arg2));
-      vfs->write(fd, "\n", 1);
+      struct iovec iov[] = {
+        { (void *)arg2, strlen(arg2) },
+        { "\n", 1 },
+      };
+      ssize_t nwrite = vfs->writev(fd, iov, 2);
       vfs->close(fd);
       sprintf(ret, "Appended %d bytes successfully.\n", nwrite);
     }
@@ -300,9 +337,10 @@ FUNC(mkdir) {
       sprintf(ret, "VFS ERROR: mkdir failed with status %d.\n"
           "Possible reasons:\n"
           " %d: command not supported by fs.\n"
+          " %d: parent dir does not exist.\n"
           " %d: dir already exists.\n"
           " %d: dir name too long.\n",
-          status, E_BADFS, E_ALRDY, E_TOOLG);
+          status, E_BADFS, E_NOENT, E_ALRDY, E_TOOLG);
     } 
   }
 }
@@ -347,3 +385,26 @@ FUNC(rm) {
     }
   }
 }
+
+FUNC(fsbench) {
+  // naivefs throughput on a scratch ramdisk at each supported block size
+  size_t nbytes = 1 << 20;
+  sprintf(ret, "naivefs, %d KiB sequential write + read:\n", nbytes >> 10);
+  for (int32_t blk_size = 512; blk_size <= (64 << 10); blk_size <<= 1) {
+    uint32_t wtime = 0, rtime = 0;
+    char line[128] = "";
+    if (naivefs_bench(blk_size, nbytes, &wtime, &rtime) < 0) {
+      sprintf(line, " %5d B: failed\n", blk_size);
+    } else {
+      sprintf(line, " %5d B: write %7d KiB/s, read %7d KiB/s\n", blk_size,
+          (nbytes >> 10) * 1000 / (wtime ? wtime : 1),
+          (nbytes >> 10) * 1000 / (rtime ? rtime : 1));
+    }
+    strcat(ret, line);
+  }
+}
+
+FUNC(sync) {
+  vfs->sync();
+  sprintf(ret, "Synced.\n");
+}
@@ -30,6 +30,7 @@ extern struct spinlock os_trap_lock;
 struct task root_task;
 _Context *null_contexts[MAX_CPU] = {};
 struct task *cpu_tasks[MAX_CPU] = {};
+struct cpu_stat cpu_stats[MAX_CPU] = {};
 
 struct task *get_current_task() {
   Assert(cpu_tasks[_cpu()] != &root_task, "cannot tun as root-task");
@@ -58,6 +59,8 @@ void kmt_init() {
   os->on_irq(0,       _EVENT_IRQ_TIMER, kmt_timer);
   os->on_irq(0,       _EVENT_YIELD,     kmt_yield);
   os->on_irq(INT_MAX, _EVENT_NULL,      kmt_context_switch);
+
+  workqueue_init();
 }
 
 int kmt_create(struct task *task, const char *name, void (*entry)(void *arg), void *arg) {
@@ -71,6 +74,9 @@ int kmt_create(struct task *task, const char *name, void (*entry)(void *arg), vo
   task->alarm   = NULL;
   task->suicide = 0;
   task->next    = NULL;
+  task->runtime = task->sleeptime = 0;
+  task->nvcsw   = task->nivcsw = 0;
+  task->last_cpu = -1;
 
   // We cannot create context before initializing the stack
   // since context will put the context at the begin of stack
@@ -86,6 +92,7 @@ int kmt_create(struct task *task, const char *name, void (*entry)(void *arg), vo
   
   // init file descriptors
   memset(task->fildes, 0, NR_FILDS * sizeof(file_t *));
+  memset(task->fdmap, 0, sizeof(task->fdmap));
 
   bool holding = spinlock_holding(&os_trap_lock);
   if (!holding) spinlock_acquire(&os_trap_lock);
@@ -121,6 +128,7 @@ struct task *kmt_sched() {
     while (tp && tp->next != cur) tp = tp->next;
     Assert(tp, "task not in task list");
     tp->next = cur->next;
+    cpu_stats[_cpu()].prev = NULL;
     pmm->free(cur);
   }
 
@@ -146,6 +154,20 @@ struct task *kmt_sched() {
 _Context *kmt_context_save(_Event ev, _Context *context) {
   Assert(spinlock_holding(&os_trap_lock), "not holding os trap lock");
   struct task *cur = get_current_task();
+
+  // charge the time since the last trap to whatever was running
+  struct cpu_stat *cs = &cpu_stats[_cpu()];
+  uint64_t now = rdtsc();
+  uint64_t delta = cs->stamp ? now - cs->stamp : 0;
+  if (cur) {
+    cur->runtime += delta;
+    cs->busy += delta;
+  } else {
+    cs->idle += delta;
+  }
+  cs->stamp = now;
+  cs->prev = cur;
+
   if (cur) {
     Assert(!cur->context, 
         "double context saving for task %d: %s [%s]", 
@@ -172,10 +194,26 @@ _Context *kmt_context_switch(_Event ev, _Context *context) {
   Assert(spinlock_holding(&os_trap_lock), "not holding os trap lock");
   _Context *ret = NULL;
   struct task *cur = get_current_task();
+
+  // a task that yielded gave up the CPU, otherwise it was preempted
+  struct cpu_stat *cs = &cpu_stats[_cpu()];
+  uint64_t now = rdtsc();
+  cs->trap += now - cs->stamp;
+  cs->stamp = now;
+  if (cs->prev && cs->prev != cur) {
+    if (ev.event == _EVENT_YIELD) {
+      ++cs->prev->nvcsw;
+    } else {
+      ++cs->prev->nivcsw;
+    }
+  }
+  cs->prev = NULL;
+
   if (cur) {
     KMTLog("Next is %d: %s", cur->pid, cur->name);
     kmt_inspect_fence(cur);
     cur->state   = ST_R;
+    cur->last_cpu = _cpu();
     ret = cur->context;
     cur->context = NULL;
     Assert(ret, "task context is empty");
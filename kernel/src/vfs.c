@@ -6,38 +6,104 @@
 inode_t *root;
 mnt_t mnt_head, mnt_root;
 spinlock_t vfs_lock;
+static int nr_mounts;
+
+static file_t ftable[NR_FILES];
+static file_t *ftable_free;
+static spinlock_t ftable_lock;
 
 inline mnt_t *find_mnt(const char *path) {
   size_t max_match = 0;
   mnt_t *ret = NULL;
   for (mnt_t *mp = mnt_head.next; mp != &mnt_head; mp = mp->next) {
-    if (!strncmp(path, mp->path, strlen(mp->path))) {
-      if (strlen(mp->path) > max_match) {
-        max_match = strlen(mp->path);
-        ret = mp;
-      }
+    if (mp->len < max_match || (ret && mp->len == max_match)) continue;
+    if (strncmp(path, mp->path, mp->len)) continue;
+    // only match on a component boundary, "/mntx" is not under "/mnt"
+    char next = path[mp->len];
+    if (next == '\0' || next == '/' || mp->path[mp->len - 1] == '/') {
+      max_match = mp->len;
+      ret = mp;
     }
   }
   VFSLog("%s is mounted by %s", path, ret->path);
   return ret;
 }
 
+inline filesystem_t *find_fs(const char *path) {
+  spinlock_acquire(&vfs_lock);
+  mnt_t *mp = find_mnt(path);
+  Assert(mp, "Path %s not mounted!", path);
+  filesystem_t *fs = mp->fs;
+  spinlock_release(&vfs_lock);
+  return fs;
+}
+
 inline file_t *find_file_by_fd(int fd) {
+  if (fd < 0 || fd >= NR_FILDS) return NULL;
   task_t *cur = get_current_task();
   return cur->fildes[fd];
 }
 
+static inline int fd_alloc(task_t *cur) {
+  // the fd table is private to its task, no lock needed
+  for (int i = 0; i < NR_FILDS / 32; ++i) {
+    uint32_t free = ~cur->fdmap[i];
+    if (free) {
+      int bit = __builtin_ctz(free);
+      cur->fdmap[i] |= 1u << bit;
+      return i * 32 + bit;
+    }
+  }
+  return -1;
+}
+
+static inline void fd_free(task_t *cur, int fd) {
+  cur->fdmap[fd / 32] &= ~(1u << (fd % 32));
+  cur->fildes[fd] = NULL;
+}
+
+static inline file_t *file_alloc() {
+  spinlock_acquire(&ftable_lock);
+  file_t *fp = ftable_free;
+  if (fp) {
+    ftable_free = fp->next;
+    fp->next = NULL;
+    fp->refcnt = 1;
+  }
+  spinlock_release(&ftable_lock);
+  return fp;
+}
+
+static inline void file_free(file_t *fp) {
+  spinlock_acquire(&ftable_lock);
+  fp->inode = NULL;
+  fp->next = ftable_free;
+  ftable_free = fp;
+  spinlock_release(&ftable_lock);
+}
+
 void vfs_init() {
+  // vfs_lock only protects the mount table, each filesystem
+  // locks its own metadata and each inode locks its own data
   spinlock_init(&vfs_lock, "vfs-lock");
 
+  pcache_init();
+
+  spinlock_init(&ftable_lock, "ftable-lock");
+  ftable_free = NULL;
+  for (int i = NR_FILES - 1; i >= 0; --i) {
+    ftable[i].next = ftable_free;
+    ftable_free = &ftable[i];
+  }
+
   root = pmm->alloc(sizeof(inode_t));
   root->refcnt = 0;
   root->type = TYPE_MNTP;
   root->flags = P_RD;
   root->ptr = NULL;
   sprintf(root->path, "/");
-  root->offset = 0;
   root->size = 4;
+  spinlock_init(&root->lock, "naivefs inode lock");
   root->fs = &naivefs;
   root->ops = &naive_ops;
   root->parent = root;
@@ -46,11 +112,13 @@ void vfs_init() {
   naivefs.root = root;
 
   mnt_root.path = "/";
+  mnt_root.len = 1;
   mnt_root.fs = &naivefs;
   mnt_root.next = &mnt_head;
   mnt_root.prev = &mnt_head;
   mnt_head.next = &mnt_root;
   mnt_head.prev = &mnt_root;
+  nr_mounts = 1;
 
   extern void mount_naivefs();
   mount_naivefs();
@@ -63,12 +131,11 @@ void vfs_init() {
 }
 
 int vfs_access(const char *path, int mode) {
-  spinlock_acquire(&vfs_lock);
-
-  mnt_t *mp = find_mnt(path);
-  Assert(mp, "Path %s not mounted!", path);
-  inode_t *ip = inode_search(root, path);
+  // the walk stays inside fs, whose lock is the only one held
+  filesystem_t *fs = find_fs(path);
+  spinlock_acquire(&fs->lock);
 
+  inode_t *ip = inode_search(fs->root, path);
   int ret = 0;
   if (strlen(ip->path) == strlen(path)) {
     if ((mode & ip->flags) != (mode & ~O_CREAT)) {
@@ -87,7 +154,8 @@ int vfs_access(const char *path, int mode) {
       ret = E_NOENT;
     }
   }
-  spinlock_release(&vfs_lock);
+
+  spinlock_release(&fs->lock);
   return ret;
 }
 
@@ -95,20 +163,29 @@ int vfs_mount(const char *path, filesystem_t *fs) {
   spinlock_acquire(&vfs_lock);
 
   mnt_t *mp = find_mnt(path);
-  Assert(!mp || strlen(mp->path) != strlen(path), "Path %s already mounted!", path);
-  
+  Assert(!mp || mp->len != strlen(path), "Path %s already mounted!", path);
+  filesystem_t *pfs = mp->fs;
+  if (nr_mounts == NR_MOUNTS) {
+    spinlock_release(&vfs_lock);
+    return E_TOOLG;
+  }
+  ++nr_mounts;
+
   mp = pmm->alloc(sizeof(mnt_t));
   mp->path = path;
+  mp->len = strlen(path);
   mp->fs = fs;
   mp->prev = mnt_head.prev;
   mp->next = &mnt_head;
   mnt_head.prev = mp;
   mp->prev->next = mp;
 
-  inode_t *pp = inode_search(root, path);
+  spinlock_acquire(&pfs->lock);
+  inode_t *pp = inode_search(pfs->root, path);
   Assert(strcmp(path, pp->path), "inode %s exists!", path);
   fs->root->parent = pp;
   inode_insert(pp, fs->root);
+  spinlock_release(&pfs->lock);
   VFSCLog(BG_YELLOW, "Path %s is mounted.", path);
 
   spinlock_release(&vfs_lock);
@@ -122,114 +199,119 @@ int vfs_unmount(const char *path) {
   Assert(mp, "Path %s not mounted!", path);
   mp->prev->next = mp->next;
   mp->next->prev = mp->prev;
+  --nr_mounts;
+  filesystem_t *fs = mp->fs;
   pmm->free(mp);
-  VFSCLog(BG_YELLOW, "Path %s is unmounted.", path);
 
   spinlock_release(&vfs_lock);
+  // the writeback runs without vfs_lock, find_fs elsewhere is not held up
+  if (fs->ops->sync) fs->ops->sync(fs);
+  VFSCLog(BG_YELLOW, "Path %s is unmounted.", path);
   return 0;
 }
 
-int vfs_readdir(const char *path, void *buf) {
+void vfs_sync() {
+  // only the list of filesystems is taken under vfs_lock, they are
+  // written back without it
+  filesystem_t *fs[NR_MOUNTS];
+  int nr = 0;
   spinlock_acquire(&vfs_lock);
+  for (mnt_t *mp = mnt_head.next; mp != &mnt_head; mp = mp->next) {
+    fs[nr++] = mp->fs;
+  }
+  spinlock_release(&vfs_lock);
+  for (int i = 0; i < nr; ++i) {
+    if (fs[i]->ops->sync) fs[i]->ops->sync(fs[i]);
+  }
+}
 
-  mnt_t *mp = find_mnt(path);
-  Assert(mp, "Path %s not mounted!", path);
-  inode_t *ip = mp->fs->ops->lookup(mp->fs, path, O_RDONLY);
+int vfs_readdir(const char *path, void *buf) {
+  filesystem_t *fs = find_fs(path);
+  spinlock_acquire(&fs->lock);
+
+  inode_t *ip = fs->ops->lookup(fs, path, O_RDONLY);
   if (!ip) {
-    spinlock_release(&vfs_lock);
+    spinlock_release(&fs->lock);
     return E_NOENT;
   }
 
-  VFSLog("inode has fs %s", mp->fs->name);
-  int ret = ip->ops->readdir(mp->fs, ip, (char *)buf);
+  VFSLog("inode has fs %s", fs->name);
+  int ret = ip->ops->readdir(fs, ip, (char *)buf);
 
-  spinlock_release(&vfs_lock);
+  spinlock_release(&fs->lock);
   return ret;
 }
 
 int vfs_mkdir(const char *path) {
-  spinlock_acquire(&vfs_lock);
-
-  mnt_t *mp = find_mnt(path);
-  Assert(mp, "Path %s not mounted!", path);
-  int ret = mp->fs->root->ops->mkdir(mp->fs, path);
-
-  spinlock_release(&vfs_lock);
+  filesystem_t *fs = find_fs(path);
+  spinlock_acquire(&fs->lock);
+  int ret = fs->root->ops->mkdir(fs, path);
+  spinlock_release(&fs->lock);
   return ret;
 }
 
 int vfs_rmdir(const char *path) {
-  spinlock_acquire(&vfs_lock);
-
-  mnt_t *mp = find_mnt(path);
-  Assert(mp, "Path %s not mounted!", path);
-  int ret = mp->fs->root->ops->rmdir(mp->fs, path);
-
-  spinlock_release(&vfs_lock);
+  filesystem_t *fs = find_fs(path);
+  spinlock_acquire(&fs->lock);
+  int ret = fs->root->ops->rmdir(fs, path);
+  spinlock_release(&fs->lock);
   return ret;
 }
 
 int vfs_link(const char *oldpath, const char *newpath) {
-  spinlock_acquire(&vfs_lock);
-
-  mnt_t *mp = find_mnt(oldpath);
-  Assert(mp, "Path %s not mounted!", oldpath);
-  inode_t *old_ip = mp->fs->ops->lookup(mp->fs, oldpath, O_RDWR);
-  int ret = mp->fs->root->ops->link(mp->fs, newpath, old_ip);
-
-  spinlock_release(&vfs_lock);
+  filesystem_t *fs = find_fs(oldpath);
+  spinlock_acquire(&fs->lock);
+  inode_t *old_ip = fs->ops->lookup(fs, oldpath, O_RDWR);
+  int ret = old_ip ? fs->root->ops->link(fs, newpath, old_ip) : E_NOENT;
+  spinlock_release(&fs->lock);
   return ret;
 }
 
 int vfs_unlink(const char *path) {
-  spinlock_acquire(&vfs_lock);
-
-  mnt_t *mp = find_mnt(path);
-  Assert(mp, "Path %s not mounted!", path);
-  int ret = mp->fs->root->ops->unlink(mp->fs, path);
-
-  spinlock_release(&vfs_lock);
+  filesystem_t *fs = find_fs(path);
+  spinlock_acquire(&fs->lock);
+  int ret = fs->root->ops->unlink(fs, path);
+  spinlock_release(&fs->lock);
   return ret;
 }
 
 int vfs_open(const char *path, int flags) {
-  int precheck = vfs_access(path, flags);
-  if (precheck) return precheck;
-  spinlock_acquire(&vfs_lock);
-
   task_t *cur = get_current_task();
-  int fd = -1;
-  file_t *fp = NULL;
-  for (int i = 0; i < NR_FILDS; ++i) {
-    if (!cur->fildes[i]) {
-      fd = i;
-      break;
-    }
-  }
-  Assert(fd != -1, "No fd is available.");
-  
-  mnt_t *mp = find_mnt(path);
-  Assert(mp, "Path %s is not mounted!", path);
-  inode_t *ip = mp->fs->ops->lookup(mp->fs, path, flags);
+  int fd = fd_alloc(cur);
+  if (fd < 0) return E_TOOLG;
+
+  // a single lookup, permissions are checked by the inode's open
+  filesystem_t *fs = find_fs(path);
+  spinlock_acquire(&fs->lock);
+  inode_t *ip = fs->ops->lookup(fs, path, flags & O_CREAT);
+  int status = 0;
   if (!ip) {
-    spinlock_release(&vfs_lock);
-    return E_NOENT;
-  }
-  if (ip->type == TYPE_DIRC || ip->type == TYPE_MNTP) {
-    spinlock_release(&vfs_lock);
-    return E_BADTP;
+    status = E_NOENT;
+  } else if (ip->type == TYPE_DIRC || ip->type == TYPE_MNTP) {
+    status = E_BADTP;
   }
 
-  fp = pmm->alloc(sizeof(file_t));
-  fp->fd = fd;
-  fp->refcnt = 0;
-  fp->flags = flags;
-  fp->inode = ip;
-  fp->offset = 0;
+  file_t *fp = NULL;
+  if (!status) {
+    fp = file_alloc();
+    if (!fp) status = E_TOOLG;
+  }
+  if (!status) {
+    fp->flags = flags;
+    fp->inode = ip;
+    fp->offset = 0;
+    fp->ptr = NULL;
+    status = ip->ops->open(fs, fp, flags);
+    if (status) {
+      file_free(fp);
+    } else {
+      ++ip->refcnt;
+    }
+  }
+  spinlock_release(&fs->lock);
 
-  int status = ip->ops->open(mp->fs, fp, flags);
-  spinlock_release(&vfs_lock);
   if (status) {
+    fd_free(cur, fd);
     return status;
   } else {
     cur->fildes[fd] = fp;
@@ -249,20 +331,79 @@ ssize_t vfs_write(int fd, void *buf, size_t nbyte) {
   return fp->inode->ops->write(fp->inode->fs, fp, buf, nbyte);
 }
 
+ssize_t vfs_pread(int fd, void *buf, size_t nbyte, off_t offset) {
+  file_t *fp = find_file_by_fd(fd);
+  Assert(fp, "file pointer is NULL");
+  return fp->inode->ops->pread(fp->inode->fs, fp, buf, nbyte, offset);
+}
+
+ssize_t vfs_pwrite(int fd, void *buf, size_t nbyte, off_t offset) {
+  file_t *fp = find_file_by_fd(fd);
+  Assert(fp, "file pointer is NULL");
+  return fp->inode->ops->pwrite(fp->inode->fs, fp, buf, nbyte, offset);
+}
+
+ssize_t vfs_readv(int fd, const struct iovec *iov, int iovcnt) {
+  file_t *fp = find_file_by_fd(fd);
+  Assert(fp, "file pointer is NULL");
+  return fp->inode->ops->readv(fp->inode->fs, fp, iov, iovcnt);
+}
+
+ssize_t vfs_writev(int fd, const struct iovec *iov, int iovcnt) {
+  file_t *fp = find_file_by_fd(fd);
+  Assert(fp, "file pointer is NULL");
+  return fp->inode->ops->writev(fp->inode->fs, fp, iov, iovcnt);
+}
+
 off_t vfs_lseek(int fd, off_t offset, int whence) {
   file_t *fp = find_file_by_fd(fd);
   Assert(fp, "file pointer is NULL");
   return fp->inode->ops->lseek(fp->inode->fs, fp, offset, whence);
 }
 
+ssize_t vfs_get_page(int fd, off_t offset, const void **page) {
+  file_t *fp = find_file_by_fd(fd);
+  Assert(fp, "file pointer is NULL");
+  return fp->inode->ops->get_page(fp->inode->fs, fp, offset, page);
+}
+
+int vfs_ioctl(int fd, int request, void *arg) {
+  file_t *fp = find_file_by_fd(fd);
+  Assert(fp, "file pointer is NULL");
+  return fp->inode->ops->ioctl(fp->inode->fs, fp, request, arg);
+}
+
 int vfs_close(int fd) {
   file_t *fp = find_file_by_fd(fd);
   Assert(fp, "file pointer is NULL");
-  int ret = fp->inode->ops->close(fp->inode->fs, fp);
+  fd_free(get_current_task(), fd);
+  spinlock_acquire(&ftable_lock);
+  int refcnt = --fp->refcnt;
+  spinlock_release(&ftable_lock);
+  if (refcnt > 0) return 0;
+
+  // last reference to the open file description
+  filesystem_t *fs = fp->inode->fs;
+  spinlock_acquire(&fs->lock);
+  --fp->inode->refcnt;
+  int ret = fp->inode->ops->close(fs, fp);
+  spinlock_release(&fs->lock);
+  file_free(fp);
+  return ret;
+}
+
+int vfs_dup(int fd) {
+  file_t *fp = find_file_by_fd(fd);
+  if (!fp) return E_NOENT;
 
   task_t *cur = get_current_task();
-  cur->fildes[fd] = NULL;
-  return ret;
+  int newfd = fd_alloc(cur);
+  if (newfd < 0) return E_TOOLG;
+  spinlock_acquire(&ftable_lock);
+  ++fp->refcnt;
+  spinlock_release(&ftable_lock);
+  cur->fildes[newfd] = fp;
+  return newfd;
 }
 
 MODULE_DEF(vfs) {
@@ -270,6 +411,7 @@ MODULE_DEF(vfs) {
   .access  = vfs_access,
   .mount   = vfs_mount,
   .unmount = vfs_unmount,
+  .sync    = vfs_sync,
   .readdir = vfs_readdir,
   .mkdir   = vfs_mkdir,
   .rmdir   = vfs_rmdir,
@@ -278,6 +420,13 @@ MODULE_DEF(vfs) {
   .open    = vfs_open,
   .read    = vfs_read,
   .write   = vfs_write,
+  .pread   = vfs_pread,
+  .pwrite  = vfs_pwrite,
+  .readv   = vfs_readv,
+  .writev  = vfs_writev,
   .lseek   = vfs_lseek,
+  .get_page = vfs_get_page,
+  .ioctl   = vfs_ioctl,
   .close   = vfs_close,
+  .dup     = vfs_dup,
 };
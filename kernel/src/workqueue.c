@@ -0,0 +1,53 @@
+#include <common.h>
+#include <workqueue.h>
+
+static struct spinlock work_lock; // protects the list and pending flags
+static struct work *work_head, *work_tail;
+static sem_t work_sem;
+
+void work_init(struct work *work, void (*func)(struct work *), void *arg) {
+  work->func = func;
+  work->arg = arg;
+  work->pending = false;
+  work->next = NULL;
+}
+
+void work_queue(struct work *work) {
+  // safe in trap context, the spinlock keeps interrupts off
+  spinlock_acquire(&work_lock);
+  bool queue = !work->pending;
+  if (queue) {
+    work->pending = true;
+    work->next = NULL;
+    if (work_tail) {
+      work_tail->next = work;
+    } else {
+      work_head = work;
+    }
+    work_tail = work;
+  }
+  spinlock_release(&work_lock);
+  if (queue) kmt->sem_signal(&work_sem);
+}
+
+static void kworker(void *arg) {
+  while (1) {
+    kmt->sem_wait(&work_sem);
+    spinlock_acquire(&work_lock);
+    struct work *work = work_head;
+    if (work) {
+      work_head = work->next;
+      if (!work_head) work_tail = NULL;
+      work->pending = false; // queueing it again from now on runs it again
+    }
+    spinlock_release(&work_lock);
+    if (work) work->func(work);
+  }
+}
+
+void workqueue_init() {
+  spinlock_init(&work_lock, "work lock");
+  work_head = work_tail = NULL;
+  kmt->sem_init(&work_sem, "work queued", 0);
+  kmt->create(pmm->alloc(sizeof(task_t)), "kworker", kworker, NULL);
+}